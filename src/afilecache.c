@@ -1,6 +1,24 @@
+#define _GNU_SOURCE
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#if defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+#endif
+#endif
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -8,34 +26,36 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
 
 
-static int cp(const char *to, const char *from)
+static int copy_fd_rw(int fd_to, int fd_from)
 {
-    int fd_to = -1, fd_from = -1;
     ssize_t nread;
     int saved_errno;
     const int buf_size = 4096 * 64;
     char * buf = NULL;
 
-    fd_from = open(from, O_RDONLY);
-    if (fd_from < 0)
-        return -1;
-
     buf = malloc(buf_size);
     if (!buf)
-        goto out_error;
-
-
-    fd_to = open(to, O_WRONLY | O_CREAT | O_EXCL, 0666);
-    if (fd_to < 0)
-        goto out_error;
+        return -1;
 
-    while (nread = read(fd_from, buf, buf_size), nread > 0)
+    while (nread = read(fd_from, buf, buf_size), nread != 0)
     {
         char *out_ptr = buf;
         ssize_t nwritten;
 
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto out_error;
+        }
+
         do {
             nwritten = write(fd_to, out_ptr, nread);
 
@@ -51,31 +71,181 @@ static int cp(const char *to, const char *from)
         } while (nread > 0);
     }
 
-    if (nread == 0)
+    free(buf);
+    return 0;
+
+  out_error:
+    saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ * Errors meaning "this copy strategy does not work for these two files",
+ * as opposed to real I/O errors.
+ */
+static int copy_strategy_unsupported(int err)
+{
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+/*
+ * Copy the data of fd_from into fd_to, starting at the current offsets of
+ * both descriptors. The copy is done in kernel with copy_file_range(), or
+ * sendfile() when that is not possible, and with read()/write() as
+ * the last resort. Since every strategy advances the file offsets,
+ * a strategy that gives up in the middle of the file is simply continued
+ * by the next one.
+ */
+static int copy_fd(int fd_to, int fd_from)
+{
+#ifdef __linux__
+    const size_t chunk_size = 1 << 30;
+    ssize_t ncopied;
+#endif
+
+#ifdef SYS_copy_file_range
+    int copied = 0;
+    while (1)
     {
-        if (close(fd_to) < 0)
+        ncopied = syscall(SYS_copy_file_range, fd_from, NULL, fd_to, NULL, chunk_size, 0);
+        if (ncopied > 0)
         {
-            fd_to = -1;
-            goto out_error;
+            copied = 1;
+            continue;
         }
-        close(fd_from);
+        if (ncopied == 0)
+        {
+            if (copied)
+                return 0;
+            /* Some filesystems report 0 instead of an error, let sendfile() decide. */
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (copy_strategy_unsupported(errno))
+            break;
+        return -1;
+    }
+#endif
+
+#ifdef __linux__
+    while (1)
+    {
+        ncopied = sendfile(fd_to, fd_from, NULL, chunk_size);
+        if (ncopied > 0)
+            continue;
+        if (ncopied == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (copy_strategy_unsupported(errno))
+            break;
+        return -1;
+    }
+#endif
 
-        free(buf);
+    return copy_fd_rw(fd_to, fd_from);
+}
 
-        /* Success! */
-        return 0;
+enum REFLINK_MODES {
+    REFLINK_NEVER,
+    REFLINK_AUTO,
+    REFLINK_ALWAYS
+};
+
+/*
+ * Share the data blocks of fd_from with the empty file fd_to.
+ * Returns 1 and leaves both offsets past the cloned data if anything was
+ * cloned, 0 if the filesystem can't do that, -1 on error.
+ * When the whole file can't be cloned (e.g. the filesystem refuses an
+ * unaligned tail), the block-aligned head is cloned with FICLONERANGE
+ * and the tail is left for copy_fd().
+ */
+static int reflink_fd(int fd_to, int fd_from)
+{
+#if defined(FICLONE) && defined(FICLONERANGE)
+    struct stat stat_buf;
+    off_t cloned;
+
+    if (fstat(fd_from, &stat_buf) < 0)
+        return -1;
+
+    if (ioctl(fd_to, FICLONE, fd_from) == 0)
+    {
+        cloned = stat_buf.st_size;
     }
+    else if (errno == EINVAL && stat_buf.st_blksize > 0 &&
+             stat_buf.st_size >= stat_buf.st_blksize)
+    {
+        struct file_clone_range range;
+        memset(&range, 0, sizeof(range));
+        range.src_fd = fd_from;
+        range.src_length = stat_buf.st_size - stat_buf.st_size % stat_buf.st_blksize;
 
-  out_error:
-    saved_errno = errno;
+        if (ioctl(fd_to, FICLONERANGE, &range) < 0)
+            return (copy_strategy_unsupported(errno) || errno == ENOTTY) ? 0 : -1;
+        cloned = range.src_length;
+    }
+    else
+    {
+        return (copy_strategy_unsupported(errno) || errno == ENOTTY) ? 0 : -1;
+    }
 
-    close(fd_from);
-    if (fd_to >= 0)
-        close(fd_to);
+    if (lseek(fd_from, cloned, SEEK_SET) < 0 || lseek(fd_to, cloned, SEEK_SET) < 0)
+        return -1;
+
+    return 1;
+#else
+    (void)(fd_to);
+    (void)(fd_from);
+    return 0;
+#endif
+}
 
-    if (buf)
-        free(buf);
+/*
+ * Fill the empty file fd_to with the contents of fd_from according to
+ * reflink_mode.
+ */
+static int clone_or_copy_fd(int fd_to, int fd_from, int reflink_mode)
+{
+    if (reflink_mode != REFLINK_NEVER)
+    {
+        int cloned = reflink_fd(fd_to, fd_from);
+        if (cloned < 0)
+            return -1;
+        if (cloned == 0 && reflink_mode == REFLINK_ALWAYS)
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+
+    return copy_fd(fd_to, fd_from);
+}
+
+static int cp_fd(const char *to, int fd_from, int reflink_mode)
+{
+    int fd_to = -1;
+    int saved_errno;
+
+    fd_to = open(to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd_to < 0)
+        return -1;
+
+    if (clone_or_copy_fd(fd_to, fd_from, reflink_mode) < 0)
+        goto out_error;
+
+    if (close(fd_to) < 0)
+        return -1;
+
+    /* Success! */
+    return 0;
 
+  out_error:
+    saved_errno = errno;
+    close(fd_to);
     errno = saved_errno;
     return -1;
 }
@@ -186,6 +356,22 @@ enum RETCODES {
 };
 
 
+/* The encoding of one character of an ID in a file name, stored in esc. */
+static const char * encode_id_char(char ch, char * esc)
+{
+    if (ch < ' ' || ch == '*' || ch == '?' || ch == '/' || ch == '\\'  || ch == '"' || ch == '\'' || ch == '%')
+    {
+        snprintf(esc, 5, "%%%u", (unsigned)ch);
+    }
+    else
+    {
+        esc[0] = ch;
+        esc[1] = 0;
+    }
+
+    return esc;
+}
+
 static char * encode_id(const char * id)
 {
     if (!id)
@@ -198,26 +384,75 @@ static char * encode_id(const char * id)
 
     while (*id)
     {
-        char ch = *id;
-        if (ch < ' ' || ch == '*' || ch == '?' || ch == '/' || ch == '\\'  || ch == '"' || ch == '\'' || ch == '%')
-        {
-            snprintf(esc, 5, "%%%u", (unsigned)ch);
-            str_buffer_join(&buffer, esc);
-        }
-        else
-        {
-            str_buffer_join_char(&buffer, ch);
-        }
+        str_buffer_join(&buffer, encode_id_char(*id, esc));
         id++;
     }
 
     return buffer.str;
 }
 
-static char * get_subdir_for_id(const char * id)
+#define SHARD_BASE ('z' - 'a')
+#define SHARD_DIGITS 4
+#define SHARD_COUNT (SHARD_BASE * SHARD_BASE * SHARD_BASE * SHARD_BASE)
+
+/*
+ * How IDs are assigned to shards, the layout setting of a cache.
+ * LAYOUT_1 is the rolling hash of the first versions, which clusters
+ * IDs with common prefixes, LAYOUT_2 a well-mixed hash of the encoded
+ * file name.
+ */
+enum LAYOUTS {
+    LAYOUT_1,
+    LAYOUT_2
+};
+
+/*
+ * The shard directories, the fanout setting of a cache: depth levels
+ * of width subdirectories each, named by hexadecimal numbers, so 2x256
+ * stores entries in 00/00 to ff/ff. Depth 0 stands for the single
+ * level of SHARD_COUNT four-letter subdirectories of older versions.
+ */
+typedef struct _fanout_t {
+    unsigned depth;
+    unsigned width;
+} fanout_t;
+
+/* Enough for any cache, and shard numbers fit in the index. */
+#define FANOUT_MAX_DEPTH 3
+#define FANOUT_MAX_SHARDS (1UL << 24)
+
+static unsigned fanout_levels(const fanout_t * fanout)
+{
+    return fanout->depth ? fanout->depth : 1;
+}
+
+static unsigned long fanout_width(const fanout_t * fanout)
+{
+    return fanout->depth ? fanout->width : SHARD_COUNT;
+}
+
+static unsigned long fanout_shard_count(const fanout_t * fanout)
+{
+    unsigned long count = 1;
+    unsigned i;
+
+    for (i = 0; i < fanout_levels(fanout); i++)
+        count *= fanout_width(fanout);
+
+    return count;
+}
+
+/* The number of hexadecimal digits in the names of the subdirectories. */
+static int fanout_digits(const fanout_t * fanout)
 {
-    unsigned base = ('z' - 'a');
+    int digits = 1;
+    while ((1UL << (4 * digits)) < fanout->width)
+        digits++;
+    return digits;
+}
 
+static unsigned long rolling_hash(const char * id)
+{
     unsigned long s = 0;
     while (*id)
     {
@@ -227,19 +462,172 @@ static char * get_subdir_for_id(const char * id)
         id++;
     }
 
-    char buf[10];
+    return s;
+}
+
+/* Parse the name of a four-letter shard directory. */
+static int parse_shard_subdir(const char * name, unsigned long * shard)
+{
+    unsigned long result = 0;
+    unsigned long weight = 1;
+    int i;
+
+    for (i = 0; i < SHARD_DIGITS; i++)
+    {
+        if (name[i] < 'a' || name[i] >= 'a' + SHARD_BASE)
+            return -1;
+        result += (name[i] - 'a') * weight;
+        weight *= SHARD_BASE;
+    }
+
+    if (name[i])
+        return -1;
+
+    *shard = result;
+    return 0;
+}
+
+/*
+ * Parse the name of a subdirectory at a level of the fanout, giving
+ * its number among the subdirectories of its parent.
+ */
+static int parse_fanout_subdir(const fanout_t * fanout, const char * name, unsigned long * number)
+{
+    if (!fanout->depth)
+        return parse_shard_subdir(name, number);
+
+    unsigned long result = 0;
+    int i;
+
+    for (i = 0; i < fanout_digits(fanout); i++)
+    {
+        if (name[i] >= '0' && name[i] <= '9')
+            result = result * 16 + (name[i] - '0');
+        else if (name[i] >= 'a' && name[i] <= 'f')
+            result = result * 16 + (name[i] - 'a' + 10);
+        else
+            return -1;
+    }
+
+    if (name[i] || result >= fanout->width)
+        return -1;
+
+    *number = result;
+    return 0;
+}
+
+static char * get_subdir_for_shard(const fanout_t * fanout, unsigned long shard)
+{
+    char buf[32];
     int i;
-    for (i = 0; i < 4; i++)
+
+    if (!fanout->depth)
+    {
+        for (i = 0; i < SHARD_DIGITS; i++)
+        {
+            buf[i] = (shard % SHARD_BASE) + 'a';
+            shard /= SHARD_BASE;
+        }
+        buf[i] = 0;
+
+        return strdup(buf);
+    }
+
+    /* The most significant level first. */
+    unsigned long numbers[FANOUT_MAX_DEPTH];
+    for (i = fanout->depth - 1; i >= 0; i--)
     {
-        buf[i] = (s % base) + 'a';
-        s /= base;
+        numbers[i] = shard % fanout->width;
+        shard /= fanout->width;
     }
-    buf[i] = 0;
+
+    int digits = fanout_digits(fanout);
+    char * p = buf;
+    for (i = 0; i < (int)fanout->depth; i++)
+        p += sprintf(p, i ? "/%0*lx" : "%0*lx", digits, numbers[i]);
 
     return strdup(buf);
 }
 
+/* The finalizer of MurmurHash3. */
+static uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+static uint64_t fnv1a_update(uint64_t h, const char * s)
+{
+    while (*s)
+    {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/* FNV-1a, with the bits mixed afterwards since the index uses the low ones. */
+static uint64_t hash64(const char * s)
+{
+    return mix64(fnv1a_update(FNV_OFFSET_BASIS, s));
+}
+
+/* Keys 0 and 1 mark free and deleted records of the index. */
+#define INDEX_KEY_FREE    0
+#define INDEX_KEY_DELETED 1
+
+/* The key of an entry in the index, computed from its file name. */
+static uint64_t get_index_key(const char * filename)
+{
+    uint64_t key = hash64(filename);
+    return key <= INDEX_KEY_DELETED ? key + 2 : key;
+}
+
+/* The same as hash64(encode_id(id)), without allocating memory. */
+static uint64_t hash_id(const char * id)
+{
+    uint64_t h = FNV_OFFSET_BASIS;
+    char esc[10];
+
+    while (*id)
+        h = fnv1a_update(h, encode_id_char(*id++, esc));
+
+    return mix64(h);
+}
+
+/* The same as get_index_key(encode_id(id)). */
+static uint64_t get_index_key_for_id(const char * id)
+{
+    uint64_t key = hash_id(id);
+    return key <= INDEX_KEY_DELETED ? key + 2 : key;
+}
+
+/* The shard of an entry in LAYOUT_2, given hash64() of its file name. */
+static unsigned long get_shard_for_hash(uint64_t hash, const fanout_t * fanout)
+{
+    /* The high bits, the index uses the low ones of the same hash. */
+    return (hash >> 32) % fanout_shard_count(fanout);
+}
+
+static unsigned long get_shard_for_id(const char * id, int layout, const fanout_t * fanout)
+{
+    if (layout == LAYOUT_1)
+        return rolling_hash(id) % fanout_shard_count(fanout);
+
+    return get_shard_for_hash(hash_id(id), fanout);
+}
+
 typedef struct _cache_entry_path_t {
+    unsigned long shard;
+    uint64_t key;
     char * dirname;
     char * filename;
     char * relpath;
@@ -247,274 +635,5125 @@ typedef struct _cache_entry_path_t {
     char * dirfullpath;
 } cache_entry_path_t;
 
-static void cache_id_to_path(const char * cache_path, const char * cache_id, cache_entry_path_t * cache_entry_path)
+/* The paths of the entry stored as filename in the given shard. filename is taken over. */
+static void cache_name_to_path(const char * cache_path, const fanout_t * fanout, unsigned long shard, char * filename,
+                               cache_entry_path_t * cache_entry_path)
 {
-    cache_entry_path->filename = encode_id(cache_id);
-    cache_entry_path->dirname  = get_subdir_for_id(cache_id);
+    cache_entry_path->filename = filename;
+    cache_entry_path->shard    = shard;
+    cache_entry_path->key      = get_index_key(cache_entry_path->filename);
+    cache_entry_path->dirname  = get_subdir_for_shard(fanout, cache_entry_path->shard);
     cache_entry_path->relpath  = str_join_path(cache_entry_path->dirname, cache_entry_path->filename, 0);
     cache_entry_path->fullpath = str_join_path(cache_path, cache_entry_path->relpath, 0);
     cache_entry_path->dirfullpath = str_join_path(cache_path, cache_entry_path->dirname, 0);
 }
 
-static int command_put(const char * cache_path, const char * cache_id, const char * source_file_path)
+static void cache_id_to_path(const char * cache_path, int layout, const fanout_t * fanout, const char * cache_id,
+                             cache_entry_path_t * cache_entry_path)
 {
-    cache_entry_path_t cache_entry_path;
-    cache_id_to_path(cache_path, cache_id, &cache_entry_path);
+    cache_name_to_path(cache_path, fanout, get_shard_for_id(cache_id, layout, fanout), encode_id(cache_id),
+                       cache_entry_path);
+}
 
-    struct stat stat_buf;
-    if (stat(cache_entry_path.dirfullpath, &stat_buf) < 0)
-    {
-        if (mkdir(cache_entry_path.dirfullpath, 0777) < 0)
-        {
-            perrorf("%s: failed to create directory %s", progname, cache_entry_path.dirfullpath);
-            return RET_FILE_OPS;
-        }
-    }
-    else if (!S_ISDIR(stat_buf.st_mode))
-    {
-        fprintf(stderr, "%s: %s: Not a directory\n", progname, cache_entry_path.dirfullpath);
-        return RET_FILE_OPS;
-    }
+static void cache_entry_path_free(cache_entry_path_t * cache_entry_path)
+{
+    free(cache_entry_path->dirname);
+    free(cache_entry_path->filename);
+    free(cache_entry_path->relpath);
+    free(cache_entry_path->fullpath);
+    free(cache_entry_path->dirfullpath);
+}
 
-    char * tmpfilename = str_join_path(cache_entry_path.dirfullpath, ".?tmpfile", 0);
+#define CACHE_ENTRY_MODE 0444
 
-    if ((unlink(tmpfilename) < 0) && errno != ENOENT)
-    {
-        perrorf("%s: failed to unlink %s", progname, tmpfilename);
-        return RET_FILE_OPS;
-    }
+enum LINK_MODES {
+    LINK_COPY,
+    LINK_HARD,
+    LINK_SYM,
+    LINK_AUTO
+};
 
-    if (cp(tmpfilename, source_file_path) < 0)
-    {
-        perrorf("%s: failed to copy %s", progname, source_file_path);
-        return RET_FILE_OPS;
-    }
+/*
+ * <cache directory>/.index records the size and times of all entries,
+ * so that cache-wide operations scan a small file instead of stat'ing
+ * every entry. It is an open addressing hash table of fixed-size records
+ * keyed by get_index_key(), accessed through a shared memory mapping.
+ * Entries whose keys collide share a record.
+ *
+ * The index is modified under its own lock, always taken after the
+ * shard lock. get updates access times without locking, so fields are
+ * written before the key of a new record is published. The table grows
+ * by writing a new file and renaming it over the old one, which is then
+ * flagged as replaced for the processes still mapping it.
+ */
+#define INDEX_MAGIC 0x3158444946464141ULL /* "AAFFIDX1" */
+#define INDEX_VERSION 3
+#define INDEX_MIN_CAPACITY 1024
+
+/* Flags of the index header. */
+#define INDEX_FLAG_SKETCH 1 /* the sketch for admission=tinylfu exists */
 
-    if (rename(tmpfilename, cache_entry_path.fullpath) < 0)
+typedef struct _index_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t replaced;
+    uint64_t capacity; /* number of records, a power of 2 */
+    uint64_t used;     /* records not free, including deleted ones */
+    uint64_t live;     /* records in use, the number of entries */
+    uint64_t total_size; /* sum of the sizes of the entries */
+    uint32_t evicting; /* put evicts until the low watermark is reached */
+    uint32_t flags;
+    uint64_t clock_hand; /* the next record visited by the clock eviction policy */
+    double   inflation;  /* GreedyDual "L": the priority of the last entry evicted by gdsf */
+    uint64_t reserved[7];
+} index_header_t;
+
+typedef struct _index_record_t {
+    uint64_t key;
+    uint64_t size;
+    int64_t  mtime; /* nanoseconds since the Epoch */
+    int64_t  atime;
+    uint32_t shard;
+    uint8_t  referenced; /* set by get, cleared by the clock hand */
+    uint8_t  migrating;  /* stored in the layout a migration started from */
+    uint8_t  reserved[2];
+    uint32_t cost;     /* milliseconds needed to recreate the entry, 0 if unknown */
+    uint32_t hits;     /* requests by get since put */
+    double   priority; /* for GreedyDual-Size-Frequency eviction */
+} index_record_t;
+
+typedef struct _eviction_candidate_t {
+    int64_t       atime;
+    uint64_t      size;
+    uint64_t      key;
+    unsigned long shard;
+    int           migrating;
+    double        priority;  /* with eviction_policy=gdsf, entries with lower ones go first */
+    unsigned      frequency; /* estimated by the sketch, entries with lower ones go next */
+} eviction_candidate_t;
+
+/*
+ * Settings of a cache, stored in <cache directory>/.config as
+ * "<name>=<value>" lines and changed with the config command.
+ */
+typedef struct _space_t {
+    unsigned long long bytes;
+    unsigned           percent; /* of the filesystem size, used instead of bytes if not 0 */
+} space_t;
+
+enum ADMISSION_POLICIES {
+    ADMIT_ALWAYS,
+    ADMIT_TINYLFU
+};
+
+enum EVICTION_POLICIES {
+    EVICT_LRU,
+    EVICT_SAMPLE,
+    EVICT_CLOCK,
+    EVICT_GDSF
+};
+
+typedef struct _config_t {
+    int                layout;
+    fanout_t           fanout;
+    int                migrate_from_layout; /* 0, or the previous layout + 1 while migrating */
+    fanout_t           migrate_from_fanout;
+    int                admission;
+    int                eviction_policy;
+    unsigned long long high_watermark; /* bytes, 0 for no automatic eviction */
+    unsigned long long low_watermark;  /* bytes, 0 for high_watermark */
+    space_t            min_free;       /* 0 for no automatic eviction */
+    space_t            target_free;    /* 0 for min_free */
+} config_t;
+
+#define EVICTION_POOL_SIZE 16
+
+/*
+ * Descriptors of recently used shard directories, so that batches and
+ * the daemon don't resolve the path of the cache for every entry. A
+ * small set associative table: each set holds the two directories last
+ * used in it, the most recent first.
+ */
+#define SHARD_DIR_SETS 8
+#define SHARD_DIR_WAYS 2
+
+typedef struct _shard_dir_t {
+    char * dirname; /* NULL if the slot is free */
+    int    fd;
+} shard_dir_t;
+
+typedef struct _cache_t {
+    const char * path;
+    char * lock_path;
+    int lock_fd;
+    int root_fd;
+    shard_dir_t shard_dirs[SHARD_DIR_SETS][SHARD_DIR_WAYS];
+    index_header_t * index;
+    size_t index_size;
+    struct _sketch_header_t * sketch;
+    size_t sketch_size;
+    struct _bloom_header_t * bloom;
+    size_t bloom_size;
+    config_t config;
+    ino_t config_ino;
+    struct timespec config_mtime;
+    uint64_t random_state;
+    /* The oldest entries seen by sampling eviction, oldest first. */
+    eviction_candidate_t eviction_pool[EVICTION_POOL_SIZE];
+    size_t eviction_pool_count;
+} cache_t;
+
+/*
+ * Modifications of the cache are serialized with byte-range locks on
+ * <cache directory>/.lock: byte N protects shard N, so operations on
+ * different shards run in parallel. The bytes following them protect
+ * the index, automatic eviction and the configuration. Open file
+ * description locks are used where available, so that threads holding
+ * separate descriptors exclude each other as well.
+ */
+#ifdef F_OFD_SETLKW
+#define CACHE_SETLKW F_OFD_SETLKW
+#define CACHE_SETLK  F_OFD_SETLK
+#else
+#define CACHE_SETLKW F_SETLKW
+#define CACHE_SETLK  F_SETLK
+#endif
+
+#define LOCK_INDEX  SHARD_COUNT
+#define LOCK_EVICT  (SHARD_COUNT + 1)
+#define LOCK_CONFIG (SHARD_COUNT + 2)
+
+static int cache_open_lock(cache_t * cache)
+{
+    cache->lock_path = str_join_path(cache->path, ".lock", 0);
+    cache->lock_fd = open(cache->lock_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (cache->lock_fd < 0)
     {
-        perrorf("%s: failed to rename %s", progname, tmpfilename);
-        return RET_FILE_OPS;
+        perrorf("%s: failed to open %s", progname, cache->lock_path);
+        return -1;
     }
 
     return 0;
 }
 
-static int command_get(const char * cache_path, const char * cache_id, const char * source_file_path)
+static void cache_init(cache_t * cache, const char * path)
 {
-    cache_entry_path_t cache_entry_path;
-    cache_id_to_path(cache_path, cache_id, &cache_entry_path);
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    cache->lock_fd = -1;
+    cache->root_fd = -1;
+}
 
-    struct stat stat_buf;
-    if (stat(cache_entry_path.fullpath, &stat_buf) < 0)
-    {
-        return RET_MISS;
-    }
+/* The descriptor of the cache directory, opened on first use. */
+static int cache_root_fd(cache_t * cache)
+{
+    if (cache->root_fd < 0)
+        cache->root_fd = open(cache->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
 
-    if ((unlink(source_file_path) < 0) && errno != ENOENT)
-    {
-        perrorf("%s: failed to unlink %s", progname, source_file_path);
-        return RET_FILE_OPS;
-    }
+    return cache->root_fd;
+}
 
-    if (cp(source_file_path, cache_entry_path.fullpath) < 0)
-    {
-        perrorf("%s: failed to copy %s", progname, cache_entry_path.fullpath);
-        unlink(source_file_path);
-        return RET_FILE_OPS;
-    }
+/*
+ * Open dirname under the cache directory. Symbolic links and ".." are
+ * not allowed to lead out of it where openat2() is available.
+ */
+static int open_beneath(int root_fd, const char * dirname)
+{
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
 
-    return 0;
+    int fd = syscall(SYS_openat2, root_fd, dirname, &how, sizeof(how));
+    if (fd >= 0 || (errno != ENOSYS && errno != EPERM))
+        return fd;
+#endif
+
+    return openat(root_fd, dirname, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
 }
 
-static int command_delete(const char * cache_path, const char * cache_id)
+/*
+ * Create the shard directory dirname, and the levels of the fanout
+ * above it that are missing.
+ */
+static int make_shard_dir(int root_fd, const char * dirname)
 {
-    cache_entry_path_t cache_entry_path;
-    cache_id_to_path(cache_path, cache_id, &cache_entry_path);
+    if (mkdirat(root_fd, dirname, 0777) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return -1;
+
+    char * path = strdup(dirname);
+    char * p = path;
+    int result = 0;
 
-    if ((unlink(cache_entry_path.fullpath) < 0))
+    while (result == 0 && (p = strchr(p, '/')) != NULL)
     {
-        if (errno == ENOENT)
-            return RET_MISS;
-        perrorf("%s: failed to unlink %s", progname, cache_entry_path.fullpath);
-        return RET_FILE_OPS;
+        *p = 0;
+        if (mkdirat(root_fd, path, 0777) < 0 && errno != EEXIST)
+            result = -1;
+        *p++ = '/';
     }
 
-    return 0;
-}
+    if (result == 0)
+        result = mkdirat(root_fd, path, 0777);
+    free(path);
 
-static int command_clean(const char * cache_path, int max_size_mb)
-{
-    /* TODO: implement me! */
-    (void)(cache_path);
-    (void)(max_size_mb);
-    fprintf(stderr, "%s: Not implemented\n", progname);
-    return RET_INTERNAL;
+    return result;
+}
+
+/* Check whether the directory opened as fd has been removed since. */
+static int dir_fd_is_removed(int fd, int error)
+{
+    struct stat stat_buf;
+
+    if (error == ESTALE)
+        return 1;
+
+    return fstat(fd, &stat_buf) == 0 && stat_buf.st_nlink == 0;
+}
+
+/*
+ * Drop the descriptor of the cache directory if the directory has been
+ * removed, so that the next use opens it again. Returns 1 if dropped.
+ * errno is preserved.
+ */
+static int cache_forget_removed_root(cache_t * cache)
+{
+    int saved_errno = errno;
+    int removed = cache->root_fd >= 0 && dir_fd_is_removed(cache->root_fd, saved_errno);
+
+    if (removed)
+    {
+        close(cache->root_fd);
+        cache->root_fd = -1;
+    }
+
+    errno = saved_errno;
+    return removed;
+}
+
+/*
+ * Called when an operation on the shard directory opened as dir_fd has
+ * failed. If the directory has been removed since its descriptor was
+ * cached, for example by a cleanup outside of afilecache while a batch
+ * or the daemon runs, the descriptor is dropped, along with that of the
+ * cache directory if it is gone too. Returns 1 if so, the operation is
+ * worth retrying once. errno is preserved.
+ */
+static int cache_forget_removed_dir(cache_t * cache, const char * dirname, int dir_fd)
+{
+    int saved_errno = errno;
+
+    if ((saved_errno != ENOENT && saved_errno != EPERM && saved_errno != ESTALE) ||
+        !dir_fd_is_removed(dir_fd, saved_errno))
+    {
+        errno = saved_errno;
+        return 0;
+    }
+
+    shard_dir_t * set = cache->shard_dirs[hash64(dirname) % SHARD_DIR_SETS];
+    int way;
+
+    for (way = 0; way < SHARD_DIR_WAYS; way++)
+    {
+        if (set[way].dirname && set[way].fd == dir_fd)
+        {
+            close(set[way].fd);
+            free(set[way].dirname);
+            memmove(&set[way], &set[way + 1], (SHARD_DIR_WAYS - 1 - way) * sizeof(shard_dir_t));
+            set[SHARD_DIR_WAYS - 1].dirname = NULL;
+            break;
+        }
+    }
+
+    cache_forget_removed_root(cache);
+
+    errno = saved_errno;
+    return 1;
+}
+
+/*
+ * The descriptor of the shard directory dirname, to be used with the
+ * *at() functions. It is created first if create is set. The descriptor
+ * is owned by the cache and stays open at least until two other
+ * directories have been looked up, or until it is found to refer to a
+ * removed directory by cache_forget_removed_dir().
+ */
+static int cache_shard_dir_fd(cache_t * cache, const char * dirname, int create)
+{
+    shard_dir_t * set = cache->shard_dirs[hash64(dirname) % SHARD_DIR_SETS];
+    int way;
+
+    for (way = 0; way < SHARD_DIR_WAYS; way++)
+    {
+        if (set[way].dirname && strcmp(set[way].dirname, dirname) == 0)
+        {
+            shard_dir_t found = set[way];
+            memmove(&set[1], &set[0], way * sizeof(shard_dir_t));
+            set[0] = found;
+            return found.fd;
+        }
+    }
+
+    int root_fd = cache_root_fd(cache);
+    if (root_fd < 0)
+        return -1;
+
+    int fd = open_beneath(root_fd, dirname);
+    if (fd < 0 && errno == ENOENT && create &&
+        (make_shard_dir(root_fd, dirname) == 0 || errno == EEXIST))
+        fd = open_beneath(root_fd, dirname);
+    if (fd < 0)
+    {
+        /* The cache directory may have been replaced, look it up again. */
+        if (errno == ENOENT && cache_forget_removed_root(cache))
+            return cache_shard_dir_fd(cache, dirname, create);
+        return -1;
+    }
+
+    shard_dir_t * last = &set[SHARD_DIR_WAYS - 1];
+    if (last->dirname)
+    {
+        close(last->fd);
+        free(last->dirname);
+    }
+    memmove(&set[1], &set[0], (SHARD_DIR_WAYS - 1) * sizeof(shard_dir_t));
+    set[0].dirname = strdup(dirname);
+    set[0].fd = fd;
+
+    return fd;
+}
+
+static int open_entry_file(cache_t * cache, const cache_entry_path_t * path)
+{
+    int attempt, fd = -1;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        int dir_fd = cache_shard_dir_fd(cache, path->dirname, 0);
+        if (dir_fd < 0)
+            return -1;
+
+        fd = openat(dir_fd, path->filename, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 || !cache_forget_removed_dir(cache, path->dirname, dir_fd))
+            break;
+    }
+
+    return fd;
+}
+
+/*
+ * Unlink the file of an entry. Returns 0, RET_MISS if there is no such
+ * file, or RET_FILE_OPS with errno set.
+ */
+static int unlink_entry(cache_t * cache, const cache_entry_path_t * path)
+{
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        int dir_fd = cache_shard_dir_fd(cache, path->dirname, 0);
+        if (dir_fd < 0)
+            break;
+
+        if (unlinkat(dir_fd, path->filename, 0) == 0)
+            return 0;
+        if (!cache_forget_removed_dir(cache, path->dirname, dir_fd))
+            break;
+    }
+
+    return errno == ENOENT ? RET_MISS : RET_FILE_OPS;
+}
+
+/*
+ * Link the entry at old_path to new_path, creating the shard directory
+ * of new_path if needed.
+ */
+static int link_entry_file(cache_t * cache, const cache_entry_path_t * old_path, const cache_entry_path_t * new_path)
+{
+    int attempt, result = -1;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        int old_dir_fd = cache_shard_dir_fd(cache, old_path->dirname, 0);
+        if (old_dir_fd < 0)
+            return -1;
+        int new_dir_fd = cache_shard_dir_fd(cache, new_path->dirname, 1);
+        if (new_dir_fd < 0)
+            return -1;
+
+        result = linkat(old_dir_fd, old_path->filename, new_dir_fd, new_path->filename, 0);
+        if (result == 0 ||
+            !(cache_forget_removed_dir(cache, old_path->dirname, old_dir_fd) |
+              cache_forget_removed_dir(cache, new_path->dirname, new_dir_fd)))
+            break;
+    }
+
+    return result;
+}
+
+static void cache_close(cache_t * cache)
+{
+    size_t i, way;
+
+    for (i = 0; i < SHARD_DIR_SETS; i++)
+    {
+        for (way = 0; way < SHARD_DIR_WAYS; way++)
+        {
+            shard_dir_t * shard_dir = &cache->shard_dirs[i][way];
+            if (shard_dir->dirname)
+            {
+                close(shard_dir->fd);
+                free(shard_dir->dirname);
+                shard_dir->dirname = NULL;
+            }
+        }
+    }
+    if (cache->root_fd >= 0)
+        close(cache->root_fd);
+    cache->root_fd = -1;
+    if (cache->lock_fd >= 0)
+        close(cache->lock_fd);
+    cache->lock_fd = -1;
+    free(cache->lock_path);
+    cache->lock_path = NULL;
+    if (cache->index)
+        munmap(cache->index, cache->index_size);
+    cache->index = NULL;
+    if (cache->sketch)
+        munmap(cache->sketch, cache->sketch_size);
+    cache->sketch = NULL;
+    if (cache->bloom)
+        munmap(cache->bloom, cache->bloom_size);
+    cache->bloom = NULL;
+}
+
+static int cache_lock_range(cache_t * cache, short type, off_t start, off_t len)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    while (fcntl(cache->lock_fd, CACHE_SETLKW, &fl) < 0)
+    {
+        if (errno != EINTR)
+        {
+            if (type != F_UNLCK)
+                perrorf("%s: failed to lock %s", progname, cache->lock_path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Take a write lock on one byte if nobody holds it. Fails silently otherwise. */
+static int cache_try_lock(cache_t * cache, off_t start)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = 1;
+
+    return fcntl(cache->lock_fd, CACHE_SETLK, &fl);
+}
+
+/* With a larger fanout, shards share the lock bytes. */
+static int cache_lock_shard(cache_t * cache, unsigned long shard)
+{
+    return cache_lock_range(cache, F_WRLCK, (off_t)(shard % SHARD_COUNT), 1);
+}
+
+static void cache_unlock_shard(cache_t * cache, unsigned long shard)
+{
+    cache_lock_range(cache, F_UNLCK, (off_t)(shard % SHARD_COUNT), 1);
+}
+
+/*
+ * Lock the shards of an entry in two layouts, in the order of the lock
+ * bytes to avoid deadlocks.
+ */
+static int cache_lock_shards(cache_t * cache, unsigned long a, unsigned long b)
+{
+    unsigned long first = a % SHARD_COUNT, second = b % SHARD_COUNT;
+
+    if (first > second)
+    {
+        unsigned long tmp = first;
+        first = second;
+        second = tmp;
+    }
+
+    if (cache_lock_shard(cache, first) < 0)
+        return -1;
+
+    if (second != first && cache_lock_shard(cache, second) < 0)
+    {
+        cache_unlock_shard(cache, first);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cache_unlock_shards(cache_t * cache, unsigned long a, unsigned long b)
+{
+    cache_unlock_shard(cache, a);
+    if (a % SHARD_COUNT != b % SHARD_COUNT)
+        cache_unlock_shard(cache, b);
+}
+
+static int parse_enum(const char * value, const char * const * names)
+{
+    int i;
+
+    if (!value)
+        return -1;
+
+    for (i = 0; names[i]; i++)
+    {
+        if (strcmp(value, names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* A size in bytes, optionally followed by K, M, G or T. */
+static int parse_size(const char * value, unsigned long long * size)
+{
+    char * end;
+    unsigned shift = 0;
+
+    if (!value || !*value || *value == '-')
+        return -1;
+
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (end == value || errno)
+        return -1;
+
+    switch (*end)
+    {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+        case 'T': shift = 40; end++; break;
+    }
+
+    if (*end || (n << shift) >> shift != n)
+        return -1;
+
+    *size = n << shift;
+    return 0;
+}
+
+/* A size, or a percentage of the filesystem size such as "10%". */
+static int parse_space(const char * value, space_t * space)
+{
+    size_t len = value ? strlen(value) : 0;
+
+    if (len > 0 && value[len - 1] == '%')
+    {
+        char * end;
+        unsigned long percent = strtoul(value, &end, 10);
+        if (end == value || *value == '-' || end != value + len - 1 || percent > 100)
+            return -1;
+        space->bytes = 0;
+        space->percent = percent;
+        return 0;
+    }
+
+    space->percent = 0;
+    return parse_size(value, &space->bytes);
+}
+
+/* "<depth>x<width>" such as "2x256", or "default" for depth 0. */
+static int parse_fanout(const char * value, fanout_t * fanout)
+{
+    if (value && strcmp(value, "default") == 0)
+    {
+        fanout->depth = 0;
+        fanout->width = 0;
+        return 0;
+    }
+
+    char * end;
+    if (!value || *value < '1' || *value > '9')
+        return -1;
+    unsigned long depth = strtoul(value, &end, 10);
+    if (*end != 'x' || end[1] < '1' || end[1] > '9')
+        return -1;
+    unsigned long width = strtoul(end + 1, &end, 10);
+    if (*end || depth > FANOUT_MAX_DEPTH || width < 2 || width > 4096)
+        return -1;
+
+    fanout_t result = {depth, width};
+    if (fanout_shard_count(&result) > FANOUT_MAX_SHARDS)
+        return -1;
+
+    *fanout = result;
+    return 0;
+}
+
+enum CONFIG_TYPES {
+    CONFIG_ENUM,
+    CONFIG_SIZE,
+    CONFIG_SPACE,
+    CONFIG_FANOUT
+};
+
+typedef struct _config_option_t {
+    const char *         name;
+    int                  type;
+    size_t               offset;
+    const char * const * names; /* of the values of CONFIG_ENUM */
+} config_option_t;
+
+/* Indexed by the values of LAYOUTS, ADMISSION_POLICIES and EVICTION_POLICIES. */
+static const char * const LAYOUT_NAMES[] = {"1", "2", NULL};
+static const char * const MIGRATE_FROM_LAYOUT_NAMES[] = {"none", "1", "2", NULL};
+static const char * const ADMISSION_POLICY_NAMES[] = {"always", "tinylfu", NULL};
+static const char * const EVICTION_POLICY_NAMES[] = {"lru", "sample", "clock", "gdsf", NULL};
+
+static const config_option_t CONFIG_OPTIONS[] = {
+    {"layout",          CONFIG_ENUM, offsetof(config_t, layout), LAYOUT_NAMES},
+    {"fanout",          CONFIG_FANOUT, offsetof(config_t, fanout), NULL},
+    {"migrate_from_layout", CONFIG_ENUM, offsetof(config_t, migrate_from_layout), MIGRATE_FROM_LAYOUT_NAMES},
+    {"migrate_from_fanout", CONFIG_FANOUT, offsetof(config_t, migrate_from_fanout), NULL},
+    {"admission",       CONFIG_ENUM, offsetof(config_t, admission), ADMISSION_POLICY_NAMES},
+    {"eviction_policy", CONFIG_ENUM, offsetof(config_t, eviction_policy), EVICTION_POLICY_NAMES},
+    {"high_watermark",  CONFIG_SIZE, offsetof(config_t, high_watermark), NULL},
+    {"low_watermark",   CONFIG_SIZE, offsetof(config_t, low_watermark), NULL},
+    {"min_free",        CONFIG_SPACE, offsetof(config_t, min_free), NULL},
+    {"target_free",     CONFIG_SPACE, offsetof(config_t, target_free), NULL},
+    {NULL, 0, 0, NULL}
+};
+
+static const config_option_t * find_config_option(const char * name)
+{
+    const config_option_t * option;
+
+    for (option = CONFIG_OPTIONS; option->name; option++)
+    {
+        if (strcmp(option->name, name) == 0)
+            return option;
+    }
+
+    return NULL;
+}
+
+static int config_set(config_t * config, const config_option_t * option, const char * value)
+{
+    void * field = (char *)config + option->offset;
+
+    switch (option->type)
+    {
+        case CONFIG_ENUM:
+        {
+            int n = parse_enum(value, option->names);
+            if (n < 0)
+                return -1;
+            *(int *)field = n;
+            return 0;
+        }
+        case CONFIG_SIZE:
+            return parse_size(value, field);
+        case CONFIG_SPACE:
+            return parse_space(value, field);
+        case CONFIG_FANOUT:
+            return parse_fanout(value, field);
+    }
+
+    return -1;
+}
+
+static void config_print(const config_t * config, const config_option_t * option, FILE * stream)
+{
+    const void * field = (const char *)config + option->offset;
+
+    switch (option->type)
+    {
+        case CONFIG_ENUM:
+            fprintf(stream, "%s", option->names[*(const int *)field]);
+            break;
+        case CONFIG_SIZE:
+            fprintf(stream, "%llu", *(const unsigned long long *)field);
+            break;
+        case CONFIG_SPACE:
+        {
+            const space_t * space = field;
+            if (space->percent)
+                fprintf(stream, "%u%%", space->percent);
+            else
+                fprintf(stream, "%llu", space->bytes);
+            break;
+        }
+        case CONFIG_FANOUT:
+        {
+            const fanout_t * fanout = field;
+            if (fanout->depth)
+                fprintf(stream, "%ux%u", fanout->depth, fanout->width);
+            else
+                fprintf(stream, "default");
+            break;
+        }
+    }
+}
+
+static int config_is_default(const config_t * config, const config_option_t * option)
+{
+    const void * field = (const char *)config + option->offset;
+
+    switch (option->type)
+    {
+        case CONFIG_ENUM:
+            return *(const int *)field == 0;
+        case CONFIG_SIZE:
+            return *(const unsigned long long *)field == 0;
+        case CONFIG_SPACE:
+            return ((const space_t *)field)->bytes == 0 && ((const space_t *)field)->percent == 0;
+        case CONFIG_FANOUT:
+            return ((const fanout_t *)field)->depth == 0;
+    }
+
+    return 1;
+}
+
+/* Check the settings for consistency. Returns an error message or NULL. */
+static const char * config_check(const config_t * config)
+{
+    if (config->high_watermark && config->low_watermark > config->high_watermark)
+        return "low_watermark exceeds high_watermark";
+
+    /* Bytes and percentages can't be compared without the filesystem size. */
+    if (config->target_free.percent)
+    {
+        if (config->min_free.percent > config->target_free.percent)
+            return "target_free is less than min_free";
+    }
+    else if (config->target_free.bytes && !config->min_free.percent)
+    {
+        if (config->min_free.bytes > config->target_free.bytes)
+            return "target_free is less than min_free";
+    }
+
+    return NULL;
+}
+
+static int fanout_equal(const fanout_t * a, const fanout_t * b)
+{
+    return a->depth == b->depth && a->width == b->width;
+}
+
+/* Check whether entries are stored at the same paths with both settings. */
+static int config_same_layout(const config_t * a, const config_t * b)
+{
+    return a->layout == b->layout && fanout_equal(&a->fanout, &b->fanout) &&
+           a->migrate_from_layout == b->migrate_from_layout &&
+           fanout_equal(&a->migrate_from_fanout, &b->migrate_from_fanout);
+}
+
+/*
+ * While migrating, entries not moved yet are stored according to
+ * migrate_from_layout and migrate_from_fanout.
+ */
+static int config_is_migrating(const config_t * config)
+{
+    return config->migrate_from_layout != 0;
+}
+
+static int space_is_set(const space_t * space)
+{
+    return space->bytes || space->percent;
+}
+
+/*
+ * What eviction aims for: a total size of the entries of at most
+ * max_size and at least min_free bytes of free space.
+ */
+typedef struct _eviction_goal_t {
+    unsigned long long max_size; /* ULLONG_MAX for no limit */
+    space_t            min_free;
+} eviction_goal_t;
+
+/* The goal that triggers automatic eviction, or with low set, the one it stops at. */
+static void config_eviction_goal(const config_t * config, int low, eviction_goal_t * goal)
+{
+    goal->max_size = config->high_watermark ? config->high_watermark : ULLONG_MAX;
+    goal->min_free = config->min_free;
+
+    if (low && config->high_watermark && config->low_watermark)
+        goal->max_size = config->low_watermark;
+    if (low && space_is_set(&config->target_free))
+        goal->min_free = config->target_free;
+}
+
+static int config_has_eviction_goal(const config_t * config)
+{
+    return config->high_watermark || space_is_set(&config->min_free);
+}
+
+/*
+ * Read the settings from path. A missing file means the defaults,
+ * invalid lines are reported and ignored.
+ */
+static int config_read(const char * path, config_t * config)
+{
+    memset(config, 0, sizeof(*config));
+
+    FILE * stream = fopen(path, "re");
+    if (!stream)
+        return errno == ENOENT ? 0 : -1;
+
+    char * line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    int line_number = 0;
+
+    while ((len = getline(&line, &line_capacity, stream)) >= 0)
+    {
+        line_number++;
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = 0;
+        if (!*line || *line == '#')
+            continue;
+
+        char * value = strchr(line, '=');
+        const config_option_t * option = NULL;
+        if (value)
+        {
+            *value++ = 0;
+            option = find_config_option(line);
+        }
+
+        if (!option || config_set(config, option, value) < 0)
+            fprintf(stderr, "%s: %s:%d: ignoring invalid setting\n", progname, path, line_number);
+    }
+
+    free(line);
+    fclose(stream);
+
+    return 0;
+}
+
+/* Write the settings differing from the defaults. The config lock must be held. */
+static int config_write(cache_t * cache, const config_t * config)
+{
+    char * path = str_join_path(cache->path, ".config", 0);
+    char * tmp_path = str_join_path(cache->path, ".config.tmp", 0);
+    const config_option_t * option;
+    int result = -1;
+
+    FILE * stream = fopen(tmp_path, "we");
+    if (stream)
+    {
+        for (option = CONFIG_OPTIONS; option->name; option++)
+        {
+            if (config_is_default(config, option))
+                continue;
+            fprintf(stream, "%s=", option->name);
+            config_print(config, option, stream);
+            fprintf(stream, "\n");
+        }
+
+        if (fclose(stream) == 0 && rename(tmp_path, path) == 0)
+            result = 0;
+    }
+
+    if (result < 0)
+    {
+        perrorf("%s: failed to write %s", progname, path);
+        unlink(tmp_path);
+    }
+
+    free(path);
+    free(tmp_path);
+
+    return result;
+}
+
+/* Read the settings of the cache, unless they are unchanged since the last time. */
+static void cache_load_config(cache_t * cache)
+{
+    char * path = str_join_path(cache->path, ".config", 0);
+    struct stat stat_buf;
+
+    /* A missing file is remembered as inode 0. */
+    if (stat(path, &stat_buf) < 0)
+        memset(&stat_buf, 0, sizeof(stat_buf));
+
+    if (stat_buf.st_ino != cache->config_ino ||
+        stat_buf.st_mtim.tv_sec != cache->config_mtime.tv_sec ||
+        stat_buf.st_mtim.tv_nsec != cache->config_mtime.tv_nsec)
+    {
+        config_read(path, &cache->config);
+        cache->config_ino = stat_buf.st_ino;
+        cache->config_mtime = stat_buf.st_mtim;
+    }
+
+    free(path);
+}
+
+/* Check whether the cache has shard directories, i.e. has been used already. */
+static int cache_has_shards(cache_t * cache)
+{
+    DIR * root = opendir(cache->path);
+    struct dirent * shard_dirent;
+    unsigned long shard;
+    int found = 0;
+
+    if (!root)
+        return 0;
+
+    while (!found && (shard_dirent = readdir(root)) != NULL)
+        found = parse_shard_subdir(shard_dirent->d_name, &shard) == 0;
+
+    closedir(root);
+
+    return found;
+}
+
+/*
+ * The settings of a cache without a settings file: caches used by
+ * versions without the layout setting keep the original layout, new
+ * ones get the current one. The config lock must be held.
+ */
+static void config_init(cache_t * cache, config_t * config)
+{
+    memset(config, 0, sizeof(*config));
+    config->layout = cache_has_shards(cache) ? LAYOUT_1 : LAYOUT_2;
+}
+
+/*
+ * Create the settings file if there is none yet, so that the layout
+ * of the cache is fixed before the first entry is put.
+ */
+static int cache_init_config(cache_t * cache)
+{
+    cache_load_config(cache);
+    if (cache->config_ino)
+        return 0;
+
+    if (cache_lock_range(cache, F_WRLCK, LOCK_CONFIG, 1) < 0)
+        return -1;
+
+    char * path = str_join_path(cache->path, ".config", 0);
+    int result = 0;
+
+    if (access(path, F_OK) < 0 && errno == ENOENT)
+    {
+        config_t config;
+        config_init(cache, &config);
+        result = config_write(cache, &config);
+    }
+
+    cache_lock_range(cache, F_UNLCK, LOCK_CONFIG, 1);
+    free(path);
+
+    cache_load_config(cache);
+
+    return result;
+}
+
+typedef void (*entry_visitor_t)(void * context, unsigned long shard, const char * name, const struct stat * stat_buf);
+
+/* Temporary files older than this are left by crashed puts. */
+#define STALE_TMPFILE_AGE (60 * 60)
+
+typedef struct _cache_walk_t {
+    const fanout_t * fanout;
+    entry_visitor_t  visitor;
+    void *           context;
+    time_t           now;
+} cache_walk_t;
+
+/*
+ * Visit the entries below the directory fd at the given level of the
+ * fanout, shard being the number of the path to it. fd is closed.
+ */
+static void walk_shard_dir(cache_walk_t * walk, int fd, unsigned level, unsigned long shard)
+{
+    DIR * dir = fdopendir(fd);
+    if (!dir)
+    {
+        close(fd);
+        return;
+    }
+
+    struct dirent * entry_dirent;
+    while ((entry_dirent = readdir(dir)) != NULL)
+    {
+        const char * name = entry_dirent->d_name;
+
+        if (level < fanout_levels(walk->fanout))
+        {
+            unsigned long number;
+            if (parse_fanout_subdir(walk->fanout, name, &number) < 0)
+                continue;
+
+            int subdir_fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (subdir_fd >= 0)
+                walk_shard_dir(walk, subdir_fd, level + 1, shard * fanout_width(walk->fanout) + number);
+            continue;
+        }
+
+        struct stat stat_buf;
+
+        if (fstatat(dirfd(dir), name, &stat_buf, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(stat_buf.st_mode))
+            continue;
+
+        if (name[0] == '.')
+        {
+            if (strncmp(name, ".?tmpfile", 9) == 0 && stat_buf.st_mtime + STALE_TMPFILE_AGE < walk->now)
+                unlinkat(dirfd(dir), name, 0);
+            continue;
+        }
+
+        walk->visitor(walk->context, shard, name, &stat_buf);
+    }
+
+    closedir(dir);
+}
+
+/*
+ * Call visitor for every entry in the shard directories of the given
+ * fanout. Stale temporary files are removed on the way.
+ */
+static int walk_cache(cache_t * cache, const fanout_t * fanout, entry_visitor_t visitor, void * context)
+{
+    int fd = open(cache->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perrorf("%s: failed to open %s", progname, cache->path);
+        return -1;
+    }
+
+    cache_walk_t walk = {fanout, visitor, context, time(NULL)};
+    walk_shard_dir(&walk, fd, 0, 0);
+
+    return 0;
+}
+
+/*
+ * Map a file of the cache directory shared for reading and writing.
+ * Fails silently, callers check the contents and decide what to do.
+ */
+static void * map_cache_file(cache_t * cache, const char * name, size_t * size)
+{
+    char * path = str_join_path(cache->path, name, 0);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    free(path);
+    if (fd < 0)
+        return NULL;
+
+    struct stat stat_buf;
+    void * map = MAP_FAILED;
+    if (fstat(fd, &stat_buf) == 0 && stat_buf.st_size > 0)
+        map = mmap(NULL, stat_buf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    *size = stat_buf.st_size;
+    return map;
+}
+
+/*
+ * Create a zero-filled file of the given size named tmp_name in the
+ * cache directory and map it, to be renamed into place once filled in
+ * by publish_cache_file(). The caller must hold the lock protecting the
+ * file, so that tmp_name is not in use.
+ */
+static void * create_cache_file(cache_t * cache, const char * tmp_name, size_t size)
+{
+    char * tmp_path = str_join_path(cache->path, tmp_name, 0);
+    void * map = MAP_FAILED;
+
+    unlink(tmp_path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd >= 0 && ftruncate(fd, size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        perrorf("%s: failed to create %s", progname, tmp_path);
+        unlink(tmp_path);
+    }
+
+    if (fd >= 0)
+        close(fd);
+    free(tmp_path);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/* Rename a file made by create_cache_file() to name. It is unmapped on failure. */
+static int publish_cache_file(cache_t * cache, const char * tmp_name, const char * name, void * map, size_t size)
+{
+    char * tmp_path = str_join_path(cache->path, tmp_name, 0);
+    char * path = str_join_path(cache->path, name, 0);
+    int result = rename(tmp_path, path);
+
+    if (result < 0)
+    {
+        perrorf("%s: failed to rename %s to %s", progname, tmp_path, path);
+        munmap(map, size);
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(path);
+
+    return result;
+}
+
+static int64_t timespec_to_ns(const struct timespec * ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static int64_t time_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return timespec_to_ns(&now);
+}
+
+static index_record_t * index_records(index_header_t * index)
+{
+    return (index_record_t *)(index + 1);
+}
+
+static size_t index_file_size(uint64_t capacity)
+{
+    return sizeof(index_header_t) + capacity * sizeof(index_record_t);
+}
+
+static void index_unmap(cache_t * cache)
+{
+    if (cache->index)
+        munmap(cache->index, cache->index_size);
+    cache->index = NULL;
+    cache->index_size = 0;
+}
+
+/*
+ * Map the current index file. Fails if it does not exist or is not
+ * valid, without printing an error, callers decide whether to rebuild.
+ */
+static int index_map(cache_t * cache)
+{
+    index_unmap(cache);
+
+    size_t size;
+    index_header_t * index = map_cache_file(cache, ".index", &size);
+    if (!index)
+        return -1;
+
+    if (size <= sizeof(index_header_t) ||
+        index->magic != INDEX_MAGIC || index->version != INDEX_VERSION ||
+        index->capacity < INDEX_MIN_CAPACITY || (index->capacity & (index->capacity - 1)) ||
+        index_file_size(index->capacity) != size)
+    {
+        munmap(index, size);
+        return -1;
+    }
+
+    cache->index = index;
+    cache->index_size = size;
+
+    return 0;
+}
+
+/* Check whether the mapping is missing or refers to a replaced file. */
+static int index_is_stale(cache_t * cache)
+{
+    return !cache->index || __atomic_load_n(&cache->index->replaced, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Find the record of key. Safe without the index lock, as long as only
+ * the fields of the record are accessed afterwards.
+ */
+static index_record_t * index_find(index_header_t * index, uint64_t key)
+{
+    index_record_t * records = index_records(index);
+    uint64_t mask = index->capacity - 1;
+    uint64_t i, n;
+
+    for (i = key & mask, n = 0; n <= mask; i = (i + 1) & mask, n++)
+    {
+        uint64_t slot_key = __atomic_load_n(&records[i].key, __ATOMIC_ACQUIRE);
+        if (slot_key == key)
+            return &records[i];
+        if (slot_key == INDEX_KEY_FREE)
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Find the record of key, or the slot for a new one: the first deleted
+ * record on the way, if any. The table must not be full.
+ */
+static index_record_t * index_find_slot(index_header_t * index, uint64_t key)
+{
+    index_record_t * records = index_records(index);
+    index_record_t * deleted = NULL;
+    uint64_t mask = index->capacity - 1;
+    uint64_t i;
+
+    for (i = key & mask; ; i = (i + 1) & mask)
+    {
+        if (records[i].key == key)
+            return &records[i];
+        if (records[i].key == INDEX_KEY_DELETED && !deleted)
+            deleted = &records[i];
+        if (records[i].key == INDEX_KEY_FREE)
+            return deleted ? deleted : &records[i];
+    }
+}
+
+static void index_store(index_header_t * index, const index_record_t * record)
+{
+    index_record_t * slot = index_find_slot(index, record->key);
+
+    if (slot->key == record->key)
+    {
+        /* A replaced entry. */
+        index->total_size += record->size - slot->size;
+        slot->size = record->size;
+        slot->mtime = record->mtime;
+        __atomic_store_n(&slot->atime, record->atime, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->referenced, record->referenced, __ATOMIC_RELAXED);
+        slot->shard = record->shard;
+        slot->migrating = record->migrating;
+        slot->cost = record->cost;
+        __atomic_store_n(&slot->hits, record->hits, __ATOMIC_RELAXED);
+        __atomic_store(&slot->priority, &record->priority, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (slot->key == INDEX_KEY_FREE)
+        index->used++;
+    index->live++;
+    index->total_size += record->size;
+
+    slot->size = record->size;
+    slot->mtime = record->mtime;
+    slot->atime = record->atime;
+    slot->shard = record->shard;
+    slot->referenced = record->referenced;
+    slot->migrating = record->migrating;
+    memset(slot->reserved, 0, sizeof(slot->reserved));
+    slot->cost = record->cost;
+    slot->hits = record->hits;
+    slot->priority = record->priority;
+    __atomic_store_n(&slot->key, record->key, __ATOMIC_RELEASE);
+}
+
+/*
+ * Create an empty index file with the given number of records under
+ * a temporary name, to be published by index_replace(). The index lock
+ * must be held.
+ */
+static index_header_t * index_create(cache_t * cache, uint64_t capacity)
+{
+    index_header_t * index = create_cache_file(cache, ".index.tmp", index_file_size(capacity));
+    if (!index)
+        return NULL;
+
+    index->magic = INDEX_MAGIC;
+    index->version = INDEX_VERSION;
+    index->capacity = capacity;
+
+    return index;
+}
+
+/* Rename the new index over the current one and switch to it. */
+static int index_replace(cache_t * cache, index_header_t * index)
+{
+    size_t size = index_file_size(index->capacity);
+
+    if (publish_cache_file(cache, ".index.tmp", ".index", index, size) < 0)
+        return -1;
+
+    if (cache->index)
+        __atomic_store_n(&cache->index->replaced, 1, __ATOMIC_RELEASE);
+    index_unmap(cache);
+    cache->index = index;
+    cache->index_size = size;
+
+    return 0;
+}
+
+/* The smallest capacity keeping the table at most half full. */
+static uint64_t index_capacity_for(uint64_t count)
+{
+    uint64_t capacity = INDEX_MIN_CAPACITY;
+    while (capacity < count * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+/*
+ * Copy the live records to a new table sized for them. This grows the
+ * table and drops the deleted records.
+ */
+static int index_grow(cache_t * cache)
+{
+    uint64_t capacity = index_capacity_for(cache->index->live + 1);
+    index_header_t * index = index_create(cache, capacity);
+    if (!index)
+        return -1;
+
+    index->inflation = cache->index->inflation;
+
+    index_record_t * records = index_records(cache->index);
+    uint64_t i;
+    for (i = 0; i < cache->index->capacity; i++)
+    {
+        index_record_t record = records[i];
+        record.atime = __atomic_load_n(&records[i].atime, __ATOMIC_RELAXED);
+        record.referenced = __atomic_load_n(&records[i].referenced, __ATOMIC_RELAXED);
+        record.hits = __atomic_load_n(&records[i].hits, __ATOMIC_RELAXED);
+        __atomic_load(&records[i].priority, &record.priority, __ATOMIC_RELAXED);
+        if (record.key > INDEX_KEY_DELETED)
+            index_store(index, &record);
+    }
+
+    return index_replace(cache, index);
+}
+
+/*
+ * <cache directory>/.bloom is a Bloom filter of the index keys of all
+ * entries, so that get answers most misses without touching the cache
+ * directories. put adds the key before publishing the entry, delete
+ * can't remove it: the filter is rebuilt from the index by clean and
+ * reindex, and by put once more keys have been added than the filter
+ * was sized for. Bits are set with atomic operations, get reads them
+ * without locking.
+ */
+#define BLOOM_MAGIC 0x314d4c4246464141ULL /* "AAFFBLM1" */
+#define BLOOM_VERSION 1
+#define BLOOM_MIN_CAPACITY 4096
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+
+typedef struct _bloom_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t replaced;
+    uint64_t bits;     /* a power of 2 */
+    uint64_t capacity; /* keys the filter is sized for */
+    uint64_t added;    /* keys added since the filter was built */
+    uint64_t reserved[3];
+} bloom_header_t;
+
+static uint64_t * bloom_words(bloom_header_t * bloom)
+{
+    return (uint64_t *)(bloom + 1);
+}
+
+static size_t bloom_file_size(uint64_t bits)
+{
+    return sizeof(bloom_header_t) + bits / 8;
+}
+
+static void bloom_unmap(cache_t * cache)
+{
+    if (cache->bloom)
+        munmap(cache->bloom, cache->bloom_size);
+    cache->bloom = NULL;
+    cache->bloom_size = 0;
+}
+
+/* Map the current filter. Fails silently if it is missing or not valid. */
+static int bloom_map(cache_t * cache)
+{
+    bloom_unmap(cache);
+
+    size_t size;
+    bloom_header_t * bloom = map_cache_file(cache, ".bloom", &size);
+    if (!bloom)
+        return -1;
+
+    if (size <= sizeof(bloom_header_t) ||
+        bloom->magic != BLOOM_MAGIC || bloom->version != BLOOM_VERSION ||
+        bloom->bits < 64 || (bloom->bits & (bloom->bits - 1)) ||
+        bloom_file_size(bloom->bits) != size)
+    {
+        munmap(bloom, size);
+        return -1;
+    }
+
+    cache->bloom = bloom;
+    cache->bloom_size = size;
+
+    return 0;
+}
+
+static int bloom_is_stale(cache_t * cache)
+{
+    return !cache->bloom || __atomic_load_n(&cache->bloom->replaced, __ATOMIC_ACQUIRE);
+}
+
+/* The i-th bit of key, by double hashing. */
+static uint64_t bloom_bit(bloom_header_t * bloom, uint64_t key, int i)
+{
+    return (key + i * (mix64(key) | 1)) & (bloom->bits - 1);
+}
+
+static void bloom_set(bloom_header_t * bloom, uint64_t key)
+{
+    uint64_t * words = bloom_words(bloom);
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = bloom_bit(bloom, key, i);
+        __atomic_fetch_or(&words[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELEASE);
+    }
+}
+
+static int bloom_test(bloom_header_t * bloom, uint64_t key)
+{
+    uint64_t * words = bloom_words(bloom);
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = bloom_bit(bloom, key, i);
+        if (!(__atomic_load_n(&words[bit / 64], __ATOMIC_ACQUIRE) & ((uint64_t)1 << (bit % 64))))
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Remove the filter, so that all entries are assumed to exist rather
+ * than a filter missing some keys being used. The index lock must be
+ * held.
+ */
+static void bloom_discard(cache_t * cache)
+{
+    char * path = str_join_path(cache->path, ".bloom", 0);
+    unlink(path);
+    free(path);
+
+    if (cache->bloom)
+        __atomic_store_n(&cache->bloom->replaced, 1, __ATOMIC_RELEASE);
+    bloom_unmap(cache);
+}
+
+/*
+ * Create a filter from the keys of the index and rename it over the
+ * current one. The index lock must be held.
+ */
+static int bloom_rebuild(cache_t * cache)
+{
+    uint64_t capacity = BLOOM_MIN_CAPACITY;
+    while (capacity < cache->index->live * 2)
+        capacity *= 2;
+
+    uint64_t bits = 64;
+    while (bits < capacity * BLOOM_BITS_PER_KEY)
+        bits *= 2;
+
+    size_t size = bloom_file_size(bits);
+    bloom_header_t * bloom = create_cache_file(cache, ".bloom.tmp", size);
+    if (!bloom)
+    {
+        bloom_discard(cache);
+        return -1;
+    }
+
+    bloom->magic = BLOOM_MAGIC;
+    bloom->version = BLOOM_VERSION;
+    bloom->bits = bits;
+    bloom->capacity = capacity;
+
+    index_record_t * records = index_records(cache->index);
+    uint64_t i;
+    for (i = 0; i < cache->index->capacity; i++)
+    {
+        if (records[i].key > INDEX_KEY_DELETED)
+        {
+            bloom_set(bloom, records[i].key);
+            bloom->added++;
+        }
+    }
+
+    if (publish_cache_file(cache, ".bloom.tmp", ".bloom", bloom, size) < 0)
+    {
+        bloom_discard(cache);
+        return -1;
+    }
+
+    if (cache->bloom)
+        __atomic_store_n(&cache->bloom->replaced, 1, __ATOMIC_RELEASE);
+    bloom_unmap(cache);
+    cache->bloom = bloom;
+    cache->bloom_size = size;
+
+    return 0;
+}
+
+/*
+ * Add a key of an entry about to be published. No lock is needed, but
+ * a concurrent rebuild may miss the key, so it is added again by
+ * bloom_update() once the entry is indexed.
+ */
+static void bloom_add(cache_t * cache, uint64_t key)
+{
+    if (bloom_is_stale(cache) && bloom_map(cache) < 0)
+        return;
+
+    bloom_set(cache->bloom, key);
+}
+
+/*
+ * Add the key of an indexed entry, creating the filter or rebuilding
+ * it when it is full. The index lock must be held.
+ */
+static int bloom_update(cache_t * cache, uint64_t key)
+{
+    if (bloom_is_stale(cache) && bloom_map(cache) < 0)
+        return bloom_rebuild(cache);
+
+    if (cache->bloom->added >= cache->bloom->capacity)
+        return bloom_rebuild(cache);
+
+    bloom_set(cache->bloom, key);
+    cache->bloom->added++;
+
+    return 0;
+}
+
+/*
+ * Check whether an entry may exist. Without a filter, this has to be
+ * assumed for every entry.
+ */
+static int bloom_may_contain(cache_t * cache, uint64_t key)
+{
+    if (bloom_is_stale(cache) && bloom_map(cache) < 0)
+        return 1;
+
+    return bloom_test(cache->bloom, key);
+}
+
+typedef struct _index_scan_t {
+    index_record_t * records;
+    size_t           count;
+    size_t           capacity;
+    const config_t * config;
+    int              migrating; /* walking the layout migrated from */
+} index_scan_t;
+
+/*
+ * Check whether the entry stored as name in the shard directory of
+ * fanout is at its place in the layout a migration goes to.
+ */
+static int entry_is_migrated(const config_t * config, const fanout_t * fanout, unsigned long shard, const char * name)
+{
+    unsigned long new_shard = get_shard_for_hash(hash64(name), &config->fanout);
+
+    if (fanout == &config->fanout)
+        return new_shard == shard;
+
+    char * dirname = get_subdir_for_shard(fanout, shard);
+    char * new_dirname = get_subdir_for_shard(&config->fanout, new_shard);
+    int result = strcmp(dirname, new_dirname) == 0;
+    free(dirname);
+    free(new_dirname);
+
+    return result;
+}
+
+static void visit_index_entry(void * context, unsigned long shard, const char * name, const struct stat * stat_buf)
+{
+    index_scan_t * scan = context;
+
+    /* While migrating, every entry belongs to one of the layouts. */
+    if (config_is_migrating(scan->config))
+    {
+        const fanout_t * fanout = scan->migrating ? &scan->config->migrate_from_fanout : &scan->config->fanout;
+        if (entry_is_migrated(scan->config, fanout, shard, name) == scan->migrating)
+            return;
+    }
+
+    if (scan->count == scan->capacity)
+    {
+        scan->capacity = scan->capacity ? scan->capacity * 2 : 1024;
+        scan->records = realloc(scan->records, scan->capacity * sizeof(index_record_t));
+        if (!scan->records)
+        {
+            fprintf(stderr, "%s: Internal error: failed to allocate %zu records\n", progname, scan->capacity);
+            abort();
+        }
+    }
+
+    index_record_t * record = &scan->records[scan->count++];
+    memset(record, 0, sizeof(*record));
+    record->key = get_index_key(name);
+    record->size = stat_buf->st_size;
+    record->mtime = timespec_to_ns(&stat_buf->st_mtim);
+    record->atime = timespec_to_ns(&stat_buf->st_atim);
+    record->shard = shard;
+    record->migrating = scan->migrating;
+}
+
+/* Milliseconds assumed for recreating an entry put without --cost. */
+#define DEFAULT_COST 1000
+
+/*
+ * The GreedyDual-Size-Frequency priority: entries that are requested
+ * often and are expensive to recreate per byte are kept longest. The
+ * inflation value ages the priorities of entries not requested lately.
+ */
+static double gdsf_priority(index_header_t * index, uint32_t hits, uint32_t cost, uint64_t size)
+{
+    double inflation;
+    __atomic_load(&index->inflation, &inflation, __ATOMIC_RELAXED);
+
+    return inflation + (double)(hits + 1) * (cost ? cost : DEFAULT_COST) / (size ? size : 1);
+}
+
+/*
+ * Recreate the index from the entries in the shard directories.
+ * Access times recorded by get are lost, those of the filesystem are
+ * used instead, and costs given to put are lost too.
+ */
+static int index_rebuild(cache_t * cache)
+{
+    index_scan_t scan = {NULL, 0, 0, &cache->config, 0};
+
+    cache_load_config(cache);
+
+    if (walk_cache(cache, &cache->config.fanout, visit_index_entry, &scan) < 0)
+        return -1;
+
+    scan.migrating = 1;
+    if (config_is_migrating(&cache->config) &&
+        walk_cache(cache, &cache->config.migrate_from_fanout, visit_index_entry, &scan) < 0)
+    {
+        free(scan.records);
+        return -1;
+    }
+
+    index_header_t * index = index_create(cache, index_capacity_for(scan.count));
+    if (!index)
+    {
+        free(scan.records);
+        return -1;
+    }
+
+    /* Keep the aging of the current index, if any, for the priorities of new entries to compare. */
+    if (cache->index)
+        index->inflation = cache->index->inflation;
+
+    size_t i;
+    for (i = 0; i < scan.count; i++)
+    {
+        scan.records[i].priority = gdsf_priority(index, 0, 0, scan.records[i].size);
+        index_store(index, &scan.records[i]);
+    }
+    free(scan.records);
+
+    if (index_replace(cache, index) < 0)
+        return -1;
+
+    /* The filter only serves lookups, the index is usable without it. */
+    bloom_rebuild(cache);
+
+    return 0;
+}
+
+/*
+ * Take the index lock and make sure the current index is mapped,
+ * rebuilding it if it is missing or damaged.
+ */
+static int index_lock(cache_t * cache)
+{
+    if (cache_lock_range(cache, F_WRLCK, LOCK_INDEX, 1) < 0)
+        return -1;
+
+    if (index_is_stale(cache) && index_map(cache) < 0 && index_rebuild(cache) < 0)
+    {
+        cache_lock_range(cache, F_UNLCK, LOCK_INDEX, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void index_unlock(cache_t * cache)
+{
+    cache_lock_range(cache, F_UNLCK, LOCK_INDEX, 1);
+}
+
+/* Record an entry written by put. The index lock must be held. */
+static int index_update(cache_t * cache, const cache_entry_path_t * cache_entry_path, const struct stat * stat_buf,
+                        uint32_t cost)
+{
+    index_header_t * index = cache->index;
+
+    if (!index_find(index, cache_entry_path->key) && (index->used + 1) * 10 > index->capacity * 7)
+    {
+        if (index_grow(cache) < 0)
+            return -1;
+        index = cache->index;
+    }
+
+    index_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.key = cache_entry_path->key;
+    record.size = stat_buf->st_size;
+    record.mtime = timespec_to_ns(&stat_buf->st_mtim);
+    record.atime = time_now_ns();
+    record.referenced = 1;
+    record.shard = cache_entry_path->shard;
+    record.cost = cost;
+    record.priority = gdsf_priority(index, 0, cost, record.size);
+    index_store(index, &record);
+
+    return 0;
+}
+
+/* Forget an entry. The index lock must be held. */
+static void index_remove(cache_t * cache, uint64_t key)
+{
+    index_record_t * record = index_find(cache->index, key);
+    if (!record)
+        return;
+
+    __atomic_store_n(&record->key, INDEX_KEY_DELETED, __ATOMIC_RELEASE);
+    cache->index->live--;
+    cache->index->total_size -= record->size;
+}
+
+/*
+ * Record an access to an entry. No lock is taken, an access racing
+ * with the replacement of the index may be lost.
+ */
+static void index_touch(cache_t * cache, uint64_t key)
+{
+    if (index_is_stale(cache) && index_map(cache) < 0)
+        return;
+
+    index_record_t * record = index_find(cache->index, key);
+    if (record)
+    {
+        uint32_t hits = __atomic_add_fetch(&record->hits, 1, __ATOMIC_RELAXED);
+        double priority = gdsf_priority(cache->index, hits, record->cost, record->size);
+
+        __atomic_store_n(&record->atime, time_now_ns(), __ATOMIC_RELAXED);
+        __atomic_store_n(&record->referenced, 1, __ATOMIC_RELAXED);
+        __atomic_store(&record->priority, &priority, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * <cache directory>/.sketch estimates how often entries are requested,
+ * for the TinyLFU admission policy. It is a count-min sketch of
+ * SKETCH_DEPTH rows of saturating counters indexed by the index key,
+ * updated without locking: a lost increment only makes the estimate
+ * slightly lower. Once the number of increments reaches reset_period,
+ * all counters are halved, so that old popularity fades out.
+ *
+ * The sketch exists once put has been run with admission=tinylfu,
+ * which is recorded in the index header, so that get knows whether
+ * it has to count requests.
+ */
+#define SKETCH_MAGIC 0x31484b5346464141ULL /* "AAFFSKH1" */
+#define SKETCH_VERSION 1
+#define SKETCH_DEPTH 4
+#define SKETCH_MIN_WIDTH 4096
+#define SKETCH_MAX_COUNT 15
+
+typedef struct _sketch_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t replaced;
+    uint64_t width; /* counters per row, a power of 2 */
+    uint64_t additions;
+    uint64_t reset_period;
+    uint64_t reserved[3];
+} sketch_header_t;
+
+static uint8_t * sketch_counters(sketch_header_t * sketch)
+{
+    return (uint8_t *)(sketch + 1);
+}
+
+static size_t sketch_file_size(uint64_t width)
+{
+    return sizeof(sketch_header_t) + SKETCH_DEPTH * width;
+}
+
+static void sketch_unmap(cache_t * cache)
+{
+    if (cache->sketch)
+        munmap(cache->sketch, cache->sketch_size);
+    cache->sketch = NULL;
+    cache->sketch_size = 0;
+}
+
+/* Map the current sketch file. Fails silently if it is missing or not valid. */
+static int sketch_map(cache_t * cache)
+{
+    sketch_unmap(cache);
+
+    size_t size;
+    sketch_header_t * sketch = map_cache_file(cache, ".sketch", &size);
+    if (!sketch)
+        return -1;
+
+    if (size <= sizeof(sketch_header_t) ||
+        sketch->magic != SKETCH_MAGIC || sketch->version != SKETCH_VERSION ||
+        sketch->width < SKETCH_MIN_WIDTH || (sketch->width & (sketch->width - 1)) ||
+        sketch_file_size(sketch->width) != size)
+    {
+        munmap(sketch, size);
+        return -1;
+    }
+
+    cache->sketch = sketch;
+    cache->sketch_size = size;
+
+    return 0;
+}
+
+static int sketch_is_stale(cache_t * cache)
+{
+    return !cache->sketch || __atomic_load_n(&cache->sketch->replaced, __ATOMIC_ACQUIRE);
+}
+
+static uint8_t * sketch_counter(sketch_header_t * sketch, uint64_t key, int row)
+{
+    uint64_t slot = mix64(key + row * 0x9e3779b97f4a7c15ULL) & (sketch->width - 1);
+    return &sketch_counters(sketch)[row * sketch->width + slot];
+}
+
+static unsigned sketch_estimate(sketch_header_t * sketch, uint64_t key)
+{
+    unsigned estimate = SKETCH_MAX_COUNT;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++)
+    {
+        unsigned count = __atomic_load_n(sketch_counter(sketch, key, row), __ATOMIC_RELAXED);
+        if (count < estimate)
+            estimate = count;
+    }
+
+    return estimate;
+}
+
+static void sketch_halve(sketch_header_t * sketch)
+{
+    uint8_t * counters = sketch_counters(sketch);
+    uint64_t i;
+
+    for (i = 0; i < SKETCH_DEPTH * sketch->width; i++)
+        __atomic_store_n(&counters[i], __atomic_load_n(&counters[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+}
+
+static void sketch_increment(sketch_header_t * sketch, uint64_t key)
+{
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; row++)
+    {
+        uint8_t * counter = sketch_counter(sketch, key, row);
+        uint8_t count = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        if (count < SKETCH_MAX_COUNT)
+            __atomic_compare_exchange_n(counter, &count, count + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+
+    /* Exactly one process reaches the period and halves the counters. */
+    if (__atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED) == sketch->reset_period)
+    {
+        sketch_halve(sketch);
+        __atomic_sub_fetch(&sketch->additions, sketch->reset_period / 2, __ATOMIC_RELAXED);
+    }
+}
+
+/* The width of the sketch suited for the given number of entries. */
+static uint64_t sketch_width_for(uint64_t count)
+{
+    uint64_t width = SKETCH_MIN_WIDTH;
+    while (width < count)
+        width *= 2;
+    return width;
+}
+
+/*
+ * Create an empty sketch sized for the entries of the index and rename
+ * it over the current one. The index lock must be held.
+ */
+static int sketch_create(cache_t * cache)
+{
+    uint64_t width = sketch_width_for(cache->index->live);
+    size_t size = sketch_file_size(width);
+
+    sketch_header_t * sketch = create_cache_file(cache, ".sketch.tmp", size);
+    if (!sketch)
+        return -1;
+
+    sketch->magic = SKETCH_MAGIC;
+    sketch->version = SKETCH_VERSION;
+    sketch->width = width;
+    /* As suggested for TinyLFU, ten times the number of counters per row. */
+    sketch->reset_period = width * 10;
+
+    if (publish_cache_file(cache, ".sketch.tmp", ".sketch", sketch, size) < 0)
+        return -1;
+
+    if (cache->sketch)
+        __atomic_store_n(&cache->sketch->replaced, 1, __ATOMIC_RELEASE);
+    sketch_unmap(cache);
+    cache->sketch = sketch;
+    cache->sketch_size = size;
+    cache->index->flags |= INDEX_FLAG_SKETCH;
+
+    return 0;
+}
+
+/*
+ * Make sure that a sketch suited for the size of the cache is mapped,
+ * creating it if needed.
+ */
+static int sketch_prepare(cache_t * cache)
+{
+    if (!sketch_is_stale(cache) && !index_is_stale(cache) &&
+        cache->sketch->width * 4 >= sketch_width_for(cache->index->live))
+        return 0;
+
+    if (index_lock(cache) < 0)
+        return -1;
+
+    int result = 0;
+    if ((sketch_is_stale(cache) && sketch_map(cache) < 0) ||
+        cache->sketch->width * 4 < sketch_width_for(cache->index->live))
+        result = sketch_create(cache);
+
+    index_unlock(cache);
+
+    return result;
+}
+
+/* Count a request for an entry, if the sketch is in use. No lock is taken. */
+static void sketch_record_request(cache_t * cache, uint64_t key)
+{
+    if (index_is_stale(cache) && index_map(cache) < 0)
+        return;
+
+    if (!(__atomic_load_n(&cache->index->flags, __ATOMIC_RELAXED) & INDEX_FLAG_SKETCH))
+        return;
+
+    if (sketch_is_stale(cache) && sketch_map(cache) < 0)
+        return;
+
+    sketch_increment(cache->sketch, key);
+}
+
+/*
+ * The estimated request count of a key, when admission=tinylfu.
+ * Otherwise 0, so that eviction is ordered by access time alone.
+ */
+static unsigned sketch_frequency(cache_t * cache, uint64_t key)
+{
+    if (cache->config.admission != ADMIT_TINYLFU)
+        return 0;
+
+    if (sketch_is_stale(cache) && sketch_map(cache) < 0)
+        return 0;
+
+    return sketch_estimate(cache->sketch, key);
+}
+
+/* Take a candidate from a record of the index. Fails for records not in use. */
+static int read_candidate(cache_t * cache, index_record_t * record, eviction_candidate_t * candidate)
+{
+    candidate->key = __atomic_load_n(&record->key, __ATOMIC_ACQUIRE);
+    if (candidate->key <= INDEX_KEY_DELETED)
+        return -1;
+
+    candidate->atime = __atomic_load_n(&record->atime, __ATOMIC_RELAXED);
+    candidate->size = record->size;
+    candidate->shard = record->shard;
+    candidate->migrating = record->migrating;
+    candidate->frequency = sketch_frequency(cache, candidate->key);
+    candidate->priority = 0;
+    if (cache->config.eviction_policy == EVICT_GDSF)
+        __atomic_load(&record->priority, &candidate->priority, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * Order candidates for eviction: lower priority, less frequently, then
+ * less recently requested first.
+ */
+static int compare_candidates(const eviction_candidate_t * a, const eviction_candidate_t * b)
+{
+    if (a->priority != b->priority)
+        return a->priority < b->priority ? -1 : 1;
+    if (a->frequency != b->frequency)
+        return a->frequency < b->frequency ? -1 : 1;
+    return (a->atime > b->atime) - (a->atime < b->atime);
+}
+
+static int compare_candidates_qsort(const void * a, const void * b)
+{
+    return compare_candidates(a, b);
+}
+
+/*
+ * The first entries in the order of compare_candidates() that together
+ * exceed the amount of bytes to free, or the first max_count ones if
+ * that is not 0. The heap has the last of them on top, so memory is
+ * bounded by the number of entries to evict rather than by the size of
+ * the cache.
+ */
+typedef struct _eviction_heap_t {
+    eviction_candidate_t * items;
+    size_t                 count;
+    size_t                 capacity;
+    size_t                 max_count;
+    unsigned long long     total_size;
+    unsigned long long     bytes_to_free;
+} eviction_heap_t;
+
+static void eviction_heap_swap(eviction_heap_t * heap, size_t a, size_t b)
+{
+    eviction_candidate_t tmp = heap->items[a];
+    heap->items[a] = heap->items[b];
+    heap->items[b] = tmp;
+}
+
+static void eviction_heap_push(eviction_heap_t * heap, const eviction_candidate_t * candidate)
+{
+    if (heap->count == heap->capacity)
+    {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+        heap->items = realloc(heap->items, heap->capacity * sizeof(eviction_candidate_t));
+        if (!heap->items)
+        {
+            fprintf(stderr, "%s: Internal error: failed to allocate %zu candidates\n", progname, heap->capacity);
+            abort();
+        }
+    }
+
+    size_t i = heap->count++;
+    heap->items[i] = *candidate;
+    heap->total_size += candidate->size;
+
+    while (i > 0 && compare_candidates(&heap->items[(i - 1) / 2], &heap->items[i]) < 0)
+    {
+        eviction_heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void eviction_heap_pop(eviction_heap_t * heap, eviction_candidate_t * candidate)
+{
+    *candidate = heap->items[0];
+    heap->total_size -= candidate->size;
+    heap->items[0] = heap->items[--heap->count];
+
+    size_t i = 0;
+    while (1)
+    {
+        size_t newest = i;
+        size_t left = i * 2 + 1, right = i * 2 + 2;
+
+        if (left < heap->count && compare_candidates(&heap->items[left], &heap->items[newest]) > 0)
+            newest = left;
+        if (right < heap->count && compare_candidates(&heap->items[right], &heap->items[newest]) > 0)
+            newest = right;
+        if (newest == i)
+            break;
+        eviction_heap_swap(heap, i, newest);
+        i = newest;
+    }
+}
+
+static int eviction_heap_is_full(const eviction_heap_t * heap)
+{
+    return heap->total_size >= heap->bytes_to_free || (heap->max_count && heap->count >= heap->max_count);
+}
+
+static void eviction_heap_offer(eviction_heap_t * heap, const eviction_candidate_t * candidate)
+{
+    if (eviction_heap_is_full(heap) && compare_candidates(candidate, &heap->items[0]) >= 0)
+        return;
+
+    eviction_heap_push(heap, candidate);
+
+    /* Drop the last entries which are not needed to reach the goal. */
+    while (heap->count > 1 && (heap->total_size - heap->items[0].size >= heap->bytes_to_free ||
+                               (heap->max_count && heap->count > heap->max_count)))
+    {
+        eviction_candidate_t dropped;
+        eviction_heap_pop(heap, &dropped);
+    }
+}
+
+/*
+ * Find the name of the entry with the given key in its shard directory.
+ * The shard lock must be held.
+ */
+static char * find_entry_name(cache_t * cache, const fanout_t * fanout, unsigned long shard, uint64_t key)
+{
+    char * dirname = get_subdir_for_shard(fanout, shard);
+    int attempt, fd = -1;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        int dir_fd = cache_shard_dir_fd(cache, dirname, 0);
+        if (dir_fd < 0)
+            break;
+
+        fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0 || !cache_forget_removed_dir(cache, dirname, dir_fd))
+            break;
+    }
+
+    DIR * dir = fd >= 0 ? fdopendir(fd) : NULL;
+    char * name = NULL;
+
+    free(dirname);
+
+    if (!dir)
+    {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    struct dirent * entry_dirent;
+    while ((entry_dirent = readdir(dir)) != NULL)
+    {
+        if (entry_dirent->d_name[0] != '.' && get_index_key(entry_dirent->d_name) == key)
+        {
+            name = strdup(entry_dirent->d_name);
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    return name;
+}
+
+/*
+ * Delete the candidate unless it has been accessed since it was chosen.
+ * A record without a file is dropped from the index as well.
+ * Returns the number of bytes freed.
+ */
+static uint64_t evict_candidate(cache_t * cache, const eviction_candidate_t * candidate)
+{
+    uint64_t freed = 0;
+
+    if (cache_lock_shard(cache, candidate->shard) < 0)
+        return 0;
+
+    const fanout_t * fanout = &cache->config.fanout;
+    if (candidate->migrating && config_is_migrating(&cache->config))
+        fanout = &cache->config.migrate_from_fanout;
+
+    char * name = find_entry_name(cache, fanout, candidate->shard, candidate->key);
+
+    /*
+     * An interrupted migrate may have left a copy in the current layout.
+     * Its shard is locked without waiting, the locks are not taken in
+     * the order of cache_lock_shards().
+     */
+    cache_entry_path_t new_path;
+    memset(&new_path, 0, sizeof(new_path));
+    new_path.shard = candidate->shard;
+    if (name && fanout != &cache->config.fanout)
+    {
+        cache_name_to_path(cache->path, &cache->config.fanout, get_shard_for_hash(hash64(name), &cache->config.fanout),
+                           strdup(name), &new_path);
+
+        if (new_path.shard % SHARD_COUNT != candidate->shard % SHARD_COUNT &&
+            cache_try_lock(cache, new_path.shard % SHARD_COUNT) < 0)
+        {
+            cache_entry_path_free(&new_path);
+            free(name);
+            cache_unlock_shard(cache, candidate->shard);
+            return 0;
+        }
+    }
+
+    if (index_lock(cache) == 0)
+    {
+        index_record_t * record = index_find(cache->index, candidate->key);
+
+        /* Also skip entries moved by migrate meanwhile. */
+        if (record && __atomic_load_n(&record->atime, __ATOMIC_RELAXED) <= candidate->atime &&
+            record->shard == candidate->shard && record->migrating == candidate->migrating)
+        {
+            cache_entry_path_t path;
+            memset(&path, 0, sizeof(path));
+            if (name)
+                cache_name_to_path(cache->path, fanout, candidate->shard, strdup(name), &path);
+
+            if (path.fullpath && unlink_entry(cache, &path) == RET_FILE_OPS)
+            {
+                perrorf("%s: failed to unlink %s", progname, path.fullpath);
+            }
+            else if (new_path.fullpath && unlink_entry(cache, &new_path) == RET_FILE_OPS)
+            {
+                perrorf("%s: failed to unlink %s", progname, new_path.fullpath);
+            }
+            else
+            {
+                freed = record->size;
+                if (cache->config.eviction_policy == EVICT_GDSF && record->priority > cache->index->inflation)
+                    cache->index->inflation = record->priority;
+                index_remove(cache, candidate->key);
+            }
+
+            cache_entry_path_free(&path);
+        }
+
+        index_unlock(cache);
+    }
+
+    free(name);
+    cache_unlock_shards(cache, candidate->shard, new_path.shard);
+    cache_entry_path_free(&new_path);
+
+    return freed;
+}
+
+/*
+ * The number of bytes to delete to reach the goal, given the total size
+ * of the entries. Deleting an entry is assumed to free its size on the
+ * filesystem, which is not the case for entries linked elsewhere.
+ */
+static unsigned long long eviction_excess(cache_t * cache, const eviction_goal_t * goal,
+                                          unsigned long long total_size)
+{
+    unsigned long long excess = total_size > goal->max_size ? total_size - goal->max_size : 0;
+    struct statvfs statvfs_buf;
+
+    if (space_is_set(&goal->min_free) && statvfs(cache->path, &statvfs_buf) == 0)
+    {
+        unsigned long long free_space = (unsigned long long)statvfs_buf.f_bavail * statvfs_buf.f_frsize;
+        unsigned long long min_free = goal->min_free.bytes;
+        if (goal->min_free.percent)
+            min_free = (unsigned long long)statvfs_buf.f_blocks * statvfs_buf.f_frsize / 100 * goal->min_free.percent;
+
+        if (free_space < min_free && min_free - free_space > excess)
+            excess = min_free - free_space;
+    }
+
+    return excess;
+}
+
+/*
+ * Delete the first entries in the order of compare_candidates(), the
+ * least recently accessed ones unless gdsf or tinylfu are used, chosen
+ * from a full scan of the index, until excess bytes are freed.
+ */
+static void evict_scan(cache_t * cache, unsigned long long excess, size_t max_victims)
+{
+    /* The mapping stays valid even if the index gets replaced meanwhile. */
+    index_header_t * index = cache->index;
+    index_record_t * records = index_records(index);
+    uint64_t i;
+
+    eviction_heap_t heap;
+    memset(&heap, 0, sizeof(heap));
+    heap.bytes_to_free = excess;
+    heap.max_count = max_victims;
+
+    for (i = 0; i < index->capacity; i++)
+    {
+        eviction_candidate_t candidate;
+
+        if (read_candidate(cache, &records[i], &candidate) == 0)
+            eviction_heap_offer(&heap, &candidate);
+    }
+
+    qsort(heap.items, heap.count, sizeof(eviction_candidate_t), compare_candidates_qsort);
+
+    unsigned long long freed = 0;
+    size_t j;
+    for (j = 0; j < heap.count && freed < heap.bytes_to_free; j++)
+        freed += evict_candidate(cache, &heap.items[j]);
+    free(heap.items);
+}
+
+/* xorshift64*, seeded on first use. */
+static uint64_t cache_random(cache_t * cache)
+{
+    if (!cache->random_state)
+        cache->random_state = (uint64_t)time_now_ns() ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)cache;
+
+    cache->random_state ^= cache->random_state >> 12;
+    cache->random_state ^= cache->random_state << 25;
+    cache->random_state ^= cache->random_state >> 27;
+
+    return cache->random_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* The number of entries sampled per eviction. */
+#define EVICTION_SAMPLES 8
+/* Give up after so many rounds in a row without deleting anything. */
+#define EVICTION_MAX_FAILURES 64
+
+/*
+ * Read up to count candidates from the records in use following a
+ * random one, so that a sparse index yields as many as a dense one.
+ * Stops after one pass over the table. Returns the number read.
+ */
+static int sample_candidates(cache_t * cache, index_header_t * index, eviction_candidate_t * candidates, int count)
+{
+    index_record_t * records = index_records(index);
+    uint64_t mask = index->capacity - 1;
+    uint64_t start = cache_random(cache) & mask;
+    uint64_t i;
+    int samples = 0;
+
+    for (i = 0; i <= mask && samples < count; i++)
+    {
+        if (read_candidate(cache, &records[(start + i) & mask], &candidates[samples]) == 0)
+            samples++;
+    }
+
+    return samples;
+}
+
+/* Add a candidate to the pool, unless it is full of older ones. */
+static void eviction_pool_offer(cache_t * cache, const eviction_candidate_t * candidate)
+{
+    eviction_candidate_t * pool = cache->eviction_pool;
+    size_t count = cache->eviction_pool_count;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (pool[i].key == candidate->key)
+            return;
+    }
+
+    i = 0;
+    while (i < count && compare_candidates(&pool[i], candidate) <= 0)
+        i++;
+    if (i == EVICTION_POOL_SIZE)
+        return;
+
+    if (count == EVICTION_POOL_SIZE)
+        count--;
+    memmove(&pool[i + 1], &pool[i], (count - i) * sizeof(eviction_candidate_t));
+    pool[i] = *candidate;
+    cache->eviction_pool_count = count + 1;
+}
+
+/* Offer EVICTION_SAMPLES randomly chosen entries to the pool. */
+static void eviction_pool_sample(cache_t * cache)
+{
+    eviction_candidate_t candidates[EVICTION_SAMPLES];
+    int samples = sample_candidates(cache, cache->index, candidates, EVICTION_SAMPLES);
+    int i;
+
+    for (i = 0; i < samples; i++)
+        eviction_pool_offer(cache, &candidates[i]);
+}
+
+/*
+ * Delete entries until excess bytes are freed, each time the oldest of
+ * a pool filled by sampling random entries of the index. The pool is
+ * kept between calls, stale candidates are caught by evict_candidate().
+ */
+static void evict_sampled(cache_t * cache, unsigned long long excess, size_t max_victims)
+{
+    unsigned long long freed = 0;
+    size_t victims = 0;
+    int failures = 0;
+
+    while (freed < excess && (!max_victims || victims < max_victims) &&
+           failures < EVICTION_MAX_FAILURES && cache->index)
+    {
+        eviction_pool_sample(cache);
+        if (cache->eviction_pool_count == 0)
+        {
+            /* A sparse index, try again. */
+            failures++;
+            continue;
+        }
+
+        eviction_candidate_t candidate = cache->eviction_pool[0];
+        cache->eviction_pool_count--;
+        memmove(&cache->eviction_pool[0], &cache->eviction_pool[1],
+                cache->eviction_pool_count * sizeof(eviction_candidate_t));
+
+        uint64_t size = evict_candidate(cache, &candidate);
+        freed += size;
+        victims++;
+        failures = size ? 0 : failures + 1;
+    }
+}
+
+/*
+ * Delete entries until excess bytes are freed, sweeping the index with
+ * the clock hand: referenced entries get their bit cleared and a second
+ * chance, the first unreferenced one is evicted. The hand is advanced
+ * atomically, so concurrent sweeps share it.
+ */
+static void evict_clock(cache_t * cache, unsigned long long excess, size_t max_victims)
+{
+    unsigned long long freed = 0;
+    size_t victims = 0;
+    uint64_t steps = 0;
+
+    /* Two turns clear all bits, so further turns only find entries in use. */
+    while (freed < excess && (!max_victims || victims < max_victims) &&
+           cache->index && steps < cache->index->capacity * 2)
+    {
+        index_header_t * index = cache->index;
+        uint64_t hand = __atomic_fetch_add(&index->clock_hand, 1, __ATOMIC_RELAXED) & (index->capacity - 1);
+        index_record_t * record = &index_records(index)[hand];
+        eviction_candidate_t candidate;
+
+        steps++;
+
+        if (read_candidate(cache, record, &candidate) < 0)
+            continue;
+
+        if (__atomic_load_n(&record->referenced, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&record->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        freed += evict_candidate(cache, &candidate);
+        victims++;
+    }
+}
+
+/*
+ * Delete entries, the least recently accessed ones as selected by the
+ * eviction policy, until the goal is reached, but no more than
+ * max_victims entries unless that is 0. The candidates are chosen
+ * without holding the index lock, every victim is checked again under
+ * the locks before deletion. A slice evicted by put samples the index
+ * rather than scanning it, so that its cost doesn't grow with the
+ * number of entries.
+ */
+static int evict_entries(cache_t * cache, const eviction_goal_t * goal, size_t max_victims)
+{
+    if (index_lock(cache) < 0)
+        return RET_LOCK;
+
+    unsigned long long total_size = cache->index->total_size;
+
+    index_unlock(cache);
+
+    unsigned long long excess = eviction_excess(cache, goal, total_size);
+    if (excess == 0)
+        return 0;
+
+    switch (cache->config.eviction_policy)
+    {
+        case EVICT_SAMPLE:
+            evict_sampled(cache, excess, max_victims);
+            break;
+        case EVICT_CLOCK:
+            evict_clock(cache, excess, max_victims);
+            break;
+        default:
+            if (max_victims)
+                evict_sampled(cache, excess, max_victims);
+            else
+                evict_scan(cache, excess, max_victims);
+            break;
+    }
+
+    return 0;
+}
+
+/* The number of entries evicted by a single put. */
+#define EVICTION_SLICE 16
+
+/*
+ * Check whether put has to evict entries: once the total size exceeds
+ * the high watermark or the free space falls below min_free, every put
+ * evicts a slice of entries until the low watermark and target_free
+ * are reached. The index lock must be held.
+ */
+static int index_needs_eviction(cache_t * cache)
+{
+    eviction_goal_t goal;
+
+    if (!config_has_eviction_goal(&cache->config))
+        return 0;
+
+    config_eviction_goal(&cache->config, 0, &goal);
+    if (eviction_excess(cache, &goal, cache->index->total_size) > 0)
+        cache->index->evicting = 1;
+
+    return cache->index->evicting != 0;
+}
+
+/* Evict a slice of entries on behalf of put. */
+static void evict_slice(cache_t * cache)
+{
+    /* While a put evicts, the others just go on. */
+    if (cache_try_lock(cache, LOCK_EVICT) < 0)
+        return;
+
+    eviction_goal_t goal;
+    config_eviction_goal(&cache->config, 1, &goal);
+    evict_entries(cache, &goal, EVICTION_SLICE);
+
+    if (index_lock(cache) == 0)
+    {
+        if (eviction_excess(cache, &goal, cache->index->total_size) == 0)
+            cache->index->evicting = 0;
+        index_unlock(cache);
+    }
+
+    cache_lock_range(cache, F_UNLCK, LOCK_EVICT, 1);
+}
+
+/*
+ * TinyLFU admission: while the cache is full, a new entry is admitted
+ * only if it has been requested more often than the entry that would
+ * be evicted for it, approximated by the least recently accessed of a
+ * few random entries. Every put counts as a request.
+ */
+static int admit_entry(cache_t * cache, uint64_t key)
+{
+    if (sketch_prepare(cache) < 0)
+        return 1;
+
+    sketch_increment(cache->sketch, key);
+
+    index_header_t * index = cache->index;
+    if (!__atomic_load_n(&index->evicting, __ATOMIC_RELAXED) || index_find(index, key))
+        return 1;
+
+    eviction_candidate_t candidates[EVICTION_SAMPLES];
+    int samples = sample_candidates(cache, index, candidates, EVICTION_SAMPLES);
+    int victim = 0, i;
+
+    for (i = 1; i < samples; i++)
+    {
+        if (compare_candidates(&candidates[i], &candidates[victim]) < 0)
+            victim = i;
+    }
+
+    return samples == 0 || sketch_estimate(cache->sketch, key) > candidates[victim].frequency;
+}
+
+/*
+ * Create an anonymous file in the directory dir, opened as dir_fd, to
+ * stage a new cache entry. On filesystems without O_TMPFILE a uniquely
+ * named file is created instead and its path is returned in *tmpfilename.
+ */
+static int create_staging_file(int dir_fd, const char * dir, char ** tmpfilename)
+{
+    int fd;
+
+    *tmpfilename = NULL;
+
+#ifdef O_TMPFILE
+    fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (fd >= 0 || !(errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+        return fd;
+#endif
+
+    *tmpfilename = str_join_path(dir, ".?tmpfile.XXXXXX", 0);
+    fd = mkostemp(*tmpfilename, O_CLOEXEC);
+    if (fd < 0)
+    {
+        int saved_errno = errno;
+        free(*tmpfilename);
+        *tmpfilename = NULL;
+        errno = saved_errno;
+    }
+
+    return fd;
+}
+
+/* Give the anonymous file fd the name filename in dir_fd. */
+static int link_staging_file(int fd, int dir_fd, const char * filename)
+{
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+
+    if (linkat(AT_FDCWD, proc_path, dir_fd, filename, AT_SYMLINK_FOLLOW) == 0)
+        return 0;
+
+    /* No /proc mounted, AT_EMPTY_PATH still works with CAP_DAC_READ_SEARCH. */
+    if (errno == ENOENT)
+        return linkat(fd, "", dir_fd, filename, AT_EMPTY_PATH);
+
+    return -1;
+}
+
+/*
+ * Atomically make the staged file visible as filename in dir_fd,
+ * replacing the previous entry if any.
+ */
+static int publish_staging_file(int fd, const char * tmpfilename, int dir_fd, const char * filename)
+{
+    if (tmpfilename)
+        return renameat(AT_FDCWD, tmpfilename, dir_fd, filename);
+
+    if (link_staging_file(fd, dir_fd, filename) == 0)
+        return 0;
+
+    if (errno != EEXIST)
+        return -1;
+
+    /* linkat() can't replace an entry: link under a unique name and rename that over it. */
+    char linkname[64];
+    unsigned attempt;
+    int result = -1;
+
+    for (attempt = 0; attempt < 100; attempt++)
+    {
+        snprintf(linkname, sizeof(linkname), ".?tmpfile.%ld.%u", (long)getpid(), attempt);
+
+        if (link_staging_file(fd, dir_fd, linkname) == 0)
+        {
+            result = renameat(dir_fd, linkname, dir_fd, filename);
+            if (result < 0)
+            {
+                int saved_errno = errno;
+                unlinkat(dir_fd, linkname, 0);
+                errno = saved_errno;
+            }
+            break;
+        }
+
+        if (errno != EEXIST)
+            break;
+    }
+
+    return result;
+}
+
+/*
+ * Publish the staged file as the entry at path, creating its shard
+ * directory if needed.
+ */
+static int publish_entry(cache_t * cache, const cache_entry_path_t * path, int fd, const char * tmpfilename)
+{
+    int attempt, result = -1;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        int dir_fd = cache_shard_dir_fd(cache, path->dirname, 1);
+        if (dir_fd < 0)
+            return -1;
+
+        result = publish_staging_file(fd, tmpfilename, dir_fd, path->filename);
+        if (result == 0 || !cache_forget_removed_dir(cache, path->dirname, dir_fd))
+            break;
+    }
+
+    return result;
+}
+
+/*
+ * Copy fd_from into a new staging file in the shard directory of
+ * the entry, creating it if needed. Returns the descriptor of the
+ * staging file, its path is returned in *tmpfilename if it has one.
+ * source_name is only used in error messages.
+ */
+static int stage_entry(cache_t * cache, const cache_entry_path_t * cache_entry_path, int fd_from,
+                       const char * source_name, int reflink_mode, char ** tmpfilename)
+{
+    *tmpfilename = NULL;
+
+    int attempt, fd_to = -1;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        int dir_fd = cache_shard_dir_fd(cache, cache_entry_path->dirname, 1);
+        if (dir_fd < 0)
+        {
+            perrorf("%s: failed to create directory %s", progname, cache_entry_path->dirfullpath);
+            return -1;
+        }
+
+        fd_to = create_staging_file(dir_fd, cache_entry_path->dirfullpath, tmpfilename);
+        if (fd_to >= 0 || !cache_forget_removed_dir(cache, cache_entry_path->dirname, dir_fd))
+            break;
+    }
+
+    if (fd_to < 0)
+    {
+        perrorf("%s: failed to create a temporary file in %s", progname, cache_entry_path->dirfullpath);
+        return -1;
+    }
+
+    int failed = 0;
+
+    if (clone_or_copy_fd(fd_to, fd_from, reflink_mode) < 0)
+    {
+        perrorf("%s: failed to copy %s", progname, source_name);
+        failed = 1;
+    }
+    /* Cache entries may be hard linked by get, keep them read-only. */
+    else if (fchmod(fd_to, CACHE_ENTRY_MODE) < 0)
+    {
+        perrorf("%s: failed to chmod a temporary file in %s", progname, cache_entry_path->dirfullpath);
+        failed = 1;
+    }
+
+    if (failed)
+    {
+        close(fd_to);
+        if (*tmpfilename)
+        {
+            unlink(*tmpfilename);
+            free(*tmpfilename);
+            *tmpfilename = NULL;
+        }
+        return -1;
+    }
+
+    return fd_to;
+}
+
+/* The paths of an entry in the layout a migration started from. */
+static void cache_id_to_old_path(cache_t * cache, const char * cache_id, cache_entry_path_t * cache_entry_path)
+{
+    cache_id_to_path(cache->path, cache->config.migrate_from_layout - 1, &cache->config.migrate_from_fanout,
+                     cache_id, cache_entry_path);
+}
+
+/*
+ * Compute the paths of an entry and lock its shard. While migrating,
+ * the paths in the previous layout are returned in *old_path and its
+ * shard is locked too, otherwise old_path->fullpath is NULL. migrate
+ * changes the layout holding all shard locks, so it stays the same
+ * until unlock_entry().
+ */
+static int lock_entry(cache_t * cache, const char * cache_id, cache_entry_path_t * path, cache_entry_path_t * old_path)
+{
+    while (1)
+    {
+        config_t config = cache->config;
+
+        cache_id_to_path(cache->path, config.layout, &config.fanout, cache_id, path);
+        memset(old_path, 0, sizeof(*old_path));
+        old_path->shard = path->shard;
+        if (config_is_migrating(&config))
+            cache_id_to_old_path(cache, cache_id, old_path);
+
+        if (cache_lock_shards(cache, path->shard, old_path->shard) < 0)
+        {
+            cache_entry_path_free(path);
+            cache_entry_path_free(old_path);
+            return -1;
+        }
+
+        cache_load_config(cache);
+        if (config_same_layout(&config, &cache->config))
+            return 0;
+
+        cache_unlock_shards(cache, path->shard, old_path->shard);
+        cache_entry_path_free(path);
+        cache_entry_path_free(old_path);
+    }
+}
+
+static void unlock_entry(cache_t * cache, cache_entry_path_t * path, cache_entry_path_t * old_path)
+{
+    cache_unlock_shards(cache, path->shard, old_path->shard);
+    cache_entry_path_free(path);
+    cache_entry_path_free(old_path);
+}
+
+static int put_entry_fd(cache_t * cache, const char * cache_id, int fd_from, const char * source_name,
+                        int reflink_mode, uint32_t cost)
+{
+    if (cache_init_config(cache) < 0)
+        return RET_FILE_OPS;
+
+    cache_entry_path_t cache_entry_path;
+    cache_id_to_path(cache->path, cache->config.layout, &cache->config.fanout, cache_id, &cache_entry_path);
+
+    /* The data is copied without holding the lock, only publishing is serialized. */
+    char * tmpfilename = NULL;
+    int fd_to = stage_entry(cache, &cache_entry_path, fd_from, source_name, reflink_mode, &tmpfilename);
+    if (fd_to < 0)
+    {
+        cache_entry_path_free(&cache_entry_path);
+        return RET_FILE_OPS;
+    }
+
+    cache_entry_path_t entry_path, old_entry_path;
+    int result = 0;
+    int evict = 0;
+    int rejected = 0;
+
+    if (cache->config.admission == ADMIT_TINYLFU && !admit_entry(cache, cache_entry_path.key))
+    {
+        /* Not worth the space, but the caller can't tell from a later eviction. */
+        rejected = 1;
+    }
+    else if (lock_entry(cache, cache_id, &entry_path, &old_entry_path) < 0)
+    {
+        result = RET_LOCK;
+    }
+    else
+    {
+        struct stat stat_buf;
+
+        /* Before the entry becomes visible, so that get never misses it. */
+        bloom_add(cache, entry_path.key);
+
+        /* migrate may have changed the layout while the data was copied. */
+        if (publish_entry(cache, &entry_path, fd_to, tmpfilename) < 0)
+        {
+            perrorf("%s: failed to publish %s", progname, entry_path.fullpath);
+            result = RET_FILE_OPS;
+        }
+        else
+        {
+            /* The copy not moved by migrate yet is outdated now. */
+            if (old_entry_path.fullpath && unlink_entry(cache, &old_entry_path) == RET_FILE_OPS)
+                perrorf("%s: failed to unlink %s", progname, old_entry_path.fullpath);
+
+            /*
+             * The entry is in place even if it can't be indexed. The
+             * filter is dropped then, a filter rebuilt from the index
+             * would miss its key.
+             */
+            int indexed = 1;
+            if (fstat(fd_to, &stat_buf) < 0)
+            {
+                perrorf("%s: failed to stat %s", progname, entry_path.fullpath);
+                indexed = 0;
+            }
+
+            if (index_lock(cache) == 0)
+            {
+                if (indexed && index_update(cache, &entry_path, &stat_buf, cost) < 0)
+                {
+                    fprintf(stderr, "%s: failed to index %s, run reindex\n", progname, entry_path.fullpath);
+                    indexed = 0;
+                }
+
+                if (indexed)
+                    bloom_update(cache, entry_path.key);
+                else
+                    bloom_discard(cache);
+                evict = index_needs_eviction(cache);
+                index_unlock(cache);
+            }
+        }
+
+        unlock_entry(cache, &entry_path, &old_entry_path);
+    }
+
+    if ((result != 0 || rejected) && tmpfilename)
+        unlink(tmpfilename);
+
+    close(fd_to);
+    free(tmpfilename);
+    cache_entry_path_free(&cache_entry_path);
+
+    if (evict)
+        evict_slice(cache);
+
+    return result;
+}
+
+static int command_put(cache_t * cache, const char * cache_id, const char * source_file_path,
+                       int reflink_mode, uint32_t cost)
+{
+    int fd_from = open(source_file_path, O_RDONLY | O_CLOEXEC);
+    if (fd_from < 0)
+    {
+        perrorf("%s: failed to open %s", progname, source_file_path);
+        return RET_FILE_OPS;
+    }
+
+    int result = put_entry_fd(cache, cache_id, fd_from, source_file_path, reflink_mode, cost);
+    close(fd_from);
+
+    return result;
+}
+
+static int link_entry(const char * entry_path, int fd_from, const char * file_path, int link_mode)
+{
+    if (link_mode == LINK_SYM)
+    {
+        char * target = realpath(entry_path, NULL);
+        if (!target)
+            return -1;
+        int result = symlink(target, file_path);
+        int saved_errno = errno;
+        free(target);
+        errno = saved_errno;
+        return result;
+    }
+
+    /* Entries put by older versions are writable, fix that before sharing the inode. */
+    fchmod(fd_from, CACHE_ENTRY_MODE);
+
+    return link(entry_path, file_path);
+}
+
+/*
+ * Make the cache entry at entry_path, opened as fd_from, available at
+ * source_file_path.
+ */
+static int deliver_entry(const char * entry_path, int fd_from,
+                         const char * source_file_path, int link_mode, int reflink_mode)
+{
+    if ((unlink(source_file_path) < 0) && errno != ENOENT)
+    {
+        perrorf("%s: failed to unlink %s", progname, source_file_path);
+        return RET_FILE_OPS;
+    }
+
+    if (link_mode != LINK_COPY)
+    {
+        if (link_entry(entry_path, fd_from, source_file_path, link_mode) == 0)
+            return 0;
+
+        /*
+         * The entry is open, so ENOENT is not a miss: it has been
+         * deleted or replaced since, and its data can still be copied.
+         */
+        if (link_mode != LINK_AUTO ||
+            !(errno == EXDEV || errno == EPERM || errno == EACCES || errno == EMLINK || errno == ENOENT))
+        {
+            perrorf("%s: failed to link %s", progname, entry_path);
+            return RET_FILE_OPS;
+        }
+    }
+
+    if (cp_fd(source_file_path, fd_from, reflink_mode) < 0)
+    {
+        perrorf("%s: failed to copy %s", progname, entry_path);
+        unlink(source_file_path);
+        return RET_FILE_OPS;
+    }
+
+    return 0;
+}
+
+/*
+ * Open the entry for reading. On success, its path is returned in
+ * *entry_path.
+ */
+static int open_entry(cache_t * cache, const char * cache_id, char ** entry_path)
+{
+    uint64_t key = get_index_key_for_id(cache_id);
+
+    /* Misses count too: an entry requested often is worth admitting. */
+    sketch_record_request(cache, key);
+
+    /* Most misses end here, without building paths or looking up the file. */
+    if (!bloom_may_contain(cache, key))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    cache_load_config(cache);
+
+    cache_entry_path_t cache_entry_path;
+    cache_id_to_path(cache->path, cache->config.layout, &cache->config.fanout, cache_id, &cache_entry_path);
+
+    /*
+     * No lock is taken: put publishes complete files with an atomic
+     * rename, and the opened descriptor keeps referring to the same
+     * data even if the entry gets replaced or deleted meanwhile.
+     */
+    int fd = open_entry_file(cache, &cache_entry_path);
+
+    if (fd < 0 && errno == ENOENT && config_is_migrating(&cache->config))
+    {
+        /* Not moved by migrate yet, or just moved, so look again. */
+        cache_entry_path_t old_entry_path;
+        cache_id_to_old_path(cache, cache_id, &old_entry_path);
+
+        fd = open_entry_file(cache, &old_entry_path);
+        if (fd >= 0)
+        {
+            free(cache_entry_path.fullpath);
+            cache_entry_path.fullpath = old_entry_path.fullpath;
+            old_entry_path.fullpath = NULL;
+        }
+        else
+        {
+            fd = open_entry_file(cache, &cache_entry_path);
+        }
+
+        cache_entry_path_free(&old_entry_path);
+    }
+
+    if (fd >= 0)
+    {
+        /* clean evicts the least recently accessed entries, don't rely on the atime mount options. */
+        index_touch(cache, cache_entry_path.key);
+
+        *entry_path = cache_entry_path.fullpath;
+        cache_entry_path.fullpath = NULL;
+    }
+
+    cache_entry_path_free(&cache_entry_path);
+
+    return fd;
+}
+
+static int command_get(cache_t * cache, const char * cache_id, const char * source_file_path,
+                       int link_mode, int reflink_mode)
+{
+    char * entry_path;
+
+    int fd_from = open_entry(cache, cache_id, &entry_path);
+    if (fd_from < 0)
+        return RET_MISS;
+
+    int result = deliver_entry(entry_path, fd_from, source_file_path, link_mode, reflink_mode);
+    close(fd_from);
+    free(entry_path);
+
+    return result;
+}
+
+static int command_delete(cache_t * cache, const char * cache_id)
+{
+    cache_entry_path_t cache_entry_path, old_entry_path;
+
+    cache_load_config(cache);
+
+    if (lock_entry(cache, cache_id, &cache_entry_path, &old_entry_path) < 0)
+        return RET_LOCK;
+
+    int result = unlink_entry(cache, &cache_entry_path);
+    if (result == RET_FILE_OPS)
+        perrorf("%s: failed to unlink %s", progname, cache_entry_path.fullpath);
+
+    /* While migrating, the entry may still be stored in the previous layout. */
+    if (old_entry_path.fullpath && result != RET_FILE_OPS)
+    {
+        int old_result = unlink_entry(cache, &old_entry_path);
+        if (old_result == RET_FILE_OPS)
+            perrorf("%s: failed to unlink %s", progname, old_entry_path.fullpath);
+        if (result == RET_MISS || old_result == RET_FILE_OPS)
+            result = old_result;
+    }
+
+    if (result != RET_FILE_OPS && index_lock(cache) == 0)
+    {
+        index_remove(cache, cache_entry_path.key);
+        index_unlock(cache);
+    }
+
+    unlock_entry(cache, &cache_entry_path, &old_entry_path);
+
+    return result;
+}
+
+/*
+ * Delete the least recently accessed entries until the total size of
+ * the cache is at most max_size bytes, or ULLONG_MAX for the low
+ * watermark, and the free space reaches target_free.
+ */
+static int command_clean(cache_t * cache, unsigned long long max_size)
+{
+    eviction_goal_t goal;
+
+    cache_load_config(cache);
+    config_eviction_goal(&cache->config, 1, &goal);
+    if (max_size != ULLONG_MAX)
+        goal.max_size = max_size;
+
+    int result = evict_entries(cache, &goal, 0);
+
+    /* Drop the keys of evicted and deleted entries from the filter. */
+    if (result == 0 && index_lock(cache) == 0)
+    {
+        bloom_rebuild(cache);
+        index_unlock(cache);
+    }
+
+    return result;
+}
+
+/* Print the number of entries and their total size. */
+static int command_stats(cache_t * cache)
+{
+    if (index_lock(cache) < 0)
+        return RET_LOCK;
+
+    unsigned long long entries = cache->index->live;
+    unsigned long long total_size = cache->index->total_size;
+
+    index_unlock(cache);
+
+    printf("entries %llu\n", entries);
+    printf("size %llu\n", total_size);
+
+    return 0;
+}
+
+/*
+ * Print how evenly the entries are spread over the shard directories:
+ * the number of shards in use, the entries in the fullest one, the
+ * mean and the ratio of the variance to the mean, which is about 1 for
+ * a uniform hash and grows as IDs cluster in fewer shards.
+ */
+static int command_shards(cache_t * cache)
+{
+    cache_load_config(cache);
+
+    if (index_lock(cache) < 0)
+        return RET_LOCK;
+
+    unsigned long shard_count = fanout_shard_count(&cache->config.fanout);
+    unsigned * counts = calloc(shard_count, sizeof(unsigned));
+    if (!counts)
+    {
+        fprintf(stderr, "%s: Internal error: failed to allocate %lu counters\n", progname, shard_count);
+        abort();
+    }
+
+    index_record_t * records = index_records(cache->index);
+    unsigned long long entries = 0, migrating = 0;
+    uint64_t i;
+
+    for (i = 0; i < cache->index->capacity; i++)
+    {
+        if (records[i].key <= INDEX_KEY_DELETED)
+            continue;
+
+        /* Their shard numbers are those of the previous fanout. */
+        if (records[i].migrating)
+        {
+            migrating++;
+        }
+        else if (records[i].shard < shard_count)
+        {
+            counts[records[i].shard]++;
+            entries++;
+        }
+    }
+
+    index_unlock(cache);
+
+    double mean = (double) entries / shard_count;
+    double variance = 0;
+    unsigned long used = 0;
+    unsigned max = 0;
+
+    for (i = 0; i < shard_count; i++)
+    {
+        double d = counts[i] - mean;
+        variance += d * d;
+        if (counts[i])
+            used++;
+        if (counts[i] > max)
+            max = counts[i];
+    }
+    variance /= shard_count;
+    free(counts);
+
+    printf("layout %s\n", LAYOUT_NAMES[cache->config.layout]);
+    printf("fanout ");
+    config_print(&cache->config, find_config_option("fanout"), stdout);
+    printf("\n");
+    printf("shards %lu\n", shard_count);
+    printf("used %lu\n", used);
+    printf("entries %llu\n", entries);
+    printf("migrating %llu\n", migrating);
+    printf("max %u\n", max);
+    printf("mean %.3f\n", mean);
+    printf("dispersion %.3f\n", entries ? variance / mean : 0.0);
+
+    return 0;
+}
+
+static int cache_is_empty(cache_t * cache)
+{
+    if (index_lock(cache) < 0)
+        return 0;
+
+    int empty = cache->index->live == 0;
+    index_unlock(cache);
+
+    return empty;
+}
+
+/* Set an option of config and write it. The config lock must be held. */
+static int config_change(cache_t * cache, config_t * config, const config_option_t * option, const char * value)
+{
+    config_t previous = *config;
+    const char * error;
+
+    if (config_set(config, option, value) < 0)
+    {
+        fprintf(stderr, "%s: invalid value for %s: %s\n", progname, option->name, value);
+        return RET_USAGE;
+    }
+
+    /* The entries put so far would not be found anymore. */
+    if (!config_same_layout(config, &previous) && !cache_is_empty(cache))
+    {
+        fprintf(stderr, "%s: %s can only be changed while the cache is empty, see migrate\n", progname, option->name);
+        return RET_USAGE;
+    }
+
+    if ((error = config_check(config)) != NULL)
+    {
+        fprintf(stderr, "%s: %s\n", progname, error);
+        return RET_USAGE;
+    }
+
+    if (config_write(cache, config) < 0)
+        return RET_FILE_OPS;
+
+    return 0;
+}
+
+/*
+ * Print all settings, print the value of one, or change it.
+ */
+static int command_config(cache_t * cache, const char * name, const char * value)
+{
+    const config_option_t * option = NULL;
+
+    if (name && !(option = find_config_option(name)))
+    {
+        fprintf(stderr, "%s: unknown setting %s\n", progname, name);
+        return RET_USAGE;
+    }
+
+    if (!value)
+    {
+        cache_load_config(cache);
+
+        for (option = option ? option : CONFIG_OPTIONS; option->name; option++)
+        {
+            if (!name)
+                printf("%s=", option->name);
+            config_print(&cache->config, option, stdout);
+            printf("\n");
+            if (name)
+                break;
+        }
+
+        return 0;
+    }
+
+    if (cache_lock_range(cache, F_WRLCK, LOCK_CONFIG, 1) < 0)
+        return RET_LOCK;
+
+    char * path = str_join_path(cache->path, ".config", 0);
+    config_t config;
+    int result = 0;
+
+    if (access(path, F_OK) < 0 && errno == ENOENT)
+    {
+        config_init(cache, &config);
+    }
+    else if (config_read(path, &config) < 0)
+    {
+        perrorf("%s: failed to read %s", progname, path);
+        result = RET_FILE_OPS;
+    }
+
+    if (result == 0)
+        result = config_change(cache, &config, option, value);
+
+    cache_lock_range(cache, F_UNLCK, LOCK_CONFIG, 1);
+    free(path);
+
+    return result;
+}
+
+/*
+ * Switch to LAYOUT_2 with the given fanout, remembering the current
+ * settings for the entries stored according to them. All shard locks
+ * are held meanwhile, so that no entry is put or deleted according to
+ * the previous settings afterwards.
+ */
+static int migrate_start(cache_t * cache, const fanout_t * fanout)
+{
+    if (cache_lock_range(cache, F_WRLCK, LOCK_CONFIG, 1) < 0)
+        return RET_LOCK;
+
+    char * path = str_join_path(cache->path, ".config", 0);
+    config_t config;
+    int result = 0;
+
+    if (access(path, F_OK) < 0 && errno == ENOENT)
+    {
+        config_init(cache, &config);
+    }
+    else if (config_read(path, &config) < 0)
+    {
+        perrorf("%s: failed to read %s", progname, path);
+        result = RET_FILE_OPS;
+    }
+
+    /* Another migrate may have started meanwhile. */
+    if (result == 0 && !config_is_migrating(&config) &&
+        (config.layout != LAYOUT_2 || !fanout_equal(&config.fanout, fanout)))
+    {
+        if (cache_lock_range(cache, F_WRLCK, 0, SHARD_COUNT) < 0)
+        {
+            result = RET_LOCK;
+        }
+        else
+        {
+            if (index_lock(cache) < 0)
+            {
+                result = RET_LOCK;
+            }
+            else
+            {
+                config.migrate_from_layout = config.layout + 1;
+                config.migrate_from_fanout = config.fanout;
+                config.layout = LAYOUT_2;
+                config.fanout = *fanout;
+
+                if (config_write(cache, &config) < 0)
+                {
+                    result = RET_FILE_OPS;
+                }
+                else
+                {
+                    index_record_t * records = index_records(cache->index);
+                    uint64_t i;
+
+                    for (i = 0; i < cache->index->capacity; i++)
+                    {
+                        if (records[i].key > INDEX_KEY_DELETED)
+                            __atomic_store_n(&records[i].migrating, 1, __ATOMIC_RELAXED);
+                    }
+                }
+
+                index_unlock(cache);
+            }
+
+            cache_lock_range(cache, F_UNLCK, 0, SHARD_COUNT);
+        }
+    }
+
+    cache_lock_range(cache, F_UNLCK, LOCK_CONFIG, 1);
+    free(path);
+
+    cache_load_config(cache);
+
+    return result;
+}
+
+/*
+ * Record that an entry is at its place in the new layout. An entry
+ * without a record, put by an older version for example, is indexed.
+ * The index lock must be held.
+ */
+static void index_migrated_entry(cache_t * cache, index_record_t * record, const cache_entry_path_t * path)
+{
+    if (record)
+    {
+        record->shard = path->shard;
+        __atomic_store_n(&record->migrating, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct stat stat_buf;
+    int fd = open_entry_file(cache, path);
+    if (fd < 0)
+        return;
+
+    if (fstat(fd, &stat_buf) == 0 && index_update(cache, path, &stat_buf, 0) == 0)
+        bloom_update(cache, path->key);
+    close(fd);
+}
+
+/*
+ * Move an entry stored as name in a shard of the previous layout to
+ * its place in the current one. An entry whose shard directory is the
+ * same in both layouts stays, only its record is updated. Returns -1
+ * on failure.
+ */
+static int migrate_entry(cache_t * cache, const config_t * config, unsigned long shard, const char * name)
+{
+    cache_entry_path_t old_path, new_path;
+    int result = 0;
+
+    cache_name_to_path(cache->path, &config->migrate_from_fanout, shard, strdup(name), &old_path);
+    cache_name_to_path(cache->path, &config->fanout, get_shard_for_hash(hash64(name), &config->fanout),
+                       strdup(name), &new_path);
+
+    if (cache_lock_shards(cache, new_path.shard, old_path.shard) < 0)
+    {
+        cache_entry_path_free(&old_path);
+        cache_entry_path_free(&new_path);
+        return -1;
+    }
+
+    if (index_lock(cache) < 0)
+    {
+        cache_unlock_shards(cache, new_path.shard, old_path.shard);
+        cache_entry_path_free(&old_path);
+        cache_entry_path_free(&new_path);
+        return -1;
+    }
+
+    /*
+     * A copy whose record is not marked as migrating anymore has been
+     * left by an interrupted move of an entry evicted or replaced since.
+     * A copy without a record is moved like the others.
+     */
+    index_record_t * record = index_find(cache->index, new_path.key);
+    int stale = record && !record->migrating;
+    int in_place = strcmp(old_path.dirname, new_path.dirname) == 0;
+
+    if (in_place)
+    {
+        if (!stale)
+            index_migrated_entry(cache, record, &new_path);
+    }
+    /* Unlike rename(), link() doesn't replace an entry put meanwhile. */
+    else if (!stale && link_entry_file(cache, &old_path, &new_path) < 0 && errno != EEXIST)
+    {
+        /* Gone, deleted meanwhile. */
+        if (errno != ENOENT)
+        {
+            perrorf("%s: failed to link %s to %s", progname, old_path.fullpath, new_path.fullpath);
+            result = -1;
+        }
+    }
+    else
+    {
+        /* Before unlinking, so that an interrupted move is completed by the next migrate. */
+        if (!stale)
+            index_migrated_entry(cache, record, &new_path);
+
+        if (unlink_entry(cache, &old_path) == RET_FILE_OPS)
+        {
+            perrorf("%s: failed to unlink %s", progname, old_path.fullpath);
+            result = -1;
+        }
+    }
+
+    index_unlock(cache);
+    cache_unlock_shards(cache, new_path.shard, old_path.shard);
+    cache_entry_path_free(&old_path);
+    cache_entry_path_free(&new_path);
+
+    return result;
+}
+
+typedef struct _migration_t {
+    cache_t * cache;
+    config_t  config;
+    int       failed;
+} migration_t;
+
+static void visit_migrated_entry(void * context, unsigned long shard, const char * name, const struct stat * stat_buf)
+{
+    migration_t * migration = context;
+    (void)stat_buf;
+
+    if (migrate_entry(migration->cache, &migration->config, shard, name) < 0)
+        migration->failed = 1;
+}
+
+/*
+ * Forget the previous layout once all entries have been moved. Records
+ * of entries still marked as not moved refer to files deleted by other
+ * means and are dropped.
+ */
+static int migrate_finish(cache_t * cache, const config_t * migrated)
+{
+    if (cache_lock_range(cache, F_WRLCK, LOCK_CONFIG, 1) < 0)
+        return RET_LOCK;
+
+    char * path = str_join_path(cache->path, ".config", 0);
+    config_t config;
+    int result = 0;
+
+    if (config_read(path, &config) < 0)
+    {
+        perrorf("%s: failed to read %s", progname, path);
+        result = RET_FILE_OPS;
+    }
+    else if (config_same_layout(&config, migrated))
+    {
+        if (index_lock(cache) < 0)
+        {
+            result = RET_LOCK;
+        }
+        else
+        {
+            config.migrate_from_layout = 0;
+            memset(&config.migrate_from_fanout, 0, sizeof(config.migrate_from_fanout));
+
+            if (config_write(cache, &config) < 0)
+            {
+                result = RET_FILE_OPS;
+            }
+            else
+            {
+                index_record_t * records = index_records(cache->index);
+                uint64_t i;
+
+                for (i = 0; i < cache->index->capacity; i++)
+                {
+                    if (records[i].key > INDEX_KEY_DELETED && records[i].migrating)
+                        index_remove(cache, records[i].key);
+                }
+            }
+
+            index_unlock(cache);
+        }
+    }
+
+    cache_lock_range(cache, F_UNLCK, LOCK_CONFIG, 1);
+    free(path);
+
+    cache_load_config(cache);
+
+    return result;
+}
+
+/*
+ * Move the entries of the cache to LAYOUT_2 with the given fanout, or
+ * the current one if NULL, while the cache stays in use. Entries are
+ * moved one at a time, an interrupted migration is completed by running
+ * migrate again.
+ */
+static int command_migrate(cache_t * cache, const fanout_t * fanout)
+{
+    cache_load_config(cache);
+
+    if (config_is_migrating(&cache->config))
+    {
+        if (fanout && !fanout_equal(fanout, &cache->config.fanout))
+        {
+            fprintf(stderr, "%s: a migration to another fanout is in progress, "
+                    "run migrate without --fanout to complete it\n", progname);
+            return RET_USAGE;
+        }
+    }
+    else
+    {
+        if (!fanout)
+            fanout = &cache->config.fanout;
+
+        if (cache->config.layout == LAYOUT_2 && fanout_equal(fanout, &cache->config.fanout))
+            return 0;
+
+        fanout_t target = *fanout;
+        int result = migrate_start(cache, &target);
+        if (result != 0)
+            return result;
+    }
+
+    migration_t migration;
+    migration.cache = cache;
+    migration.config = cache->config;
+    migration.failed = 0;
+
+    if (!config_is_migrating(&migration.config))
+        return 0;
+
+    if (walk_cache(cache, &migration.config.migrate_from_fanout, visit_migrated_entry, &migration) < 0 ||
+        migration.failed)
+        return RET_FILE_OPS;
+
+    return migrate_finish(cache, &migration.config);
+}
+
+/* Rebuild the index from the cache directories. */
+static int command_reindex(cache_t * cache)
+{
+    if (cache_lock_range(cache, F_WRLCK, LOCK_INDEX, 1) < 0)
+        return RET_LOCK;
+
+    int result = index_rebuild(cache) < 0 ? RET_FILE_OPS : 0;
+
+    index_unlock(cache);
+
+    return result;
 }
 
 #define TOSTR(s) #s
 
-const char * USAGE = 
-"Version 0.1.1\n"
-"Usage:\n"
-"    afilecache <cache directory> put <ID> <file path>\n"
-"    afilecache <cache directory> get <ID> <file path>\n"
-"    afilecache <cache directory> delete <ID>\n"
-/*"\tafilecache <cache directory> clean <max size in MB>\n" XXX: NOT IMPLEMENTED*/
-"\n"
-"afilecache is a utility to atomically put files in a cache directory.\n"
-"\n"
-"When running,  afilecache acquires a lock on <cache directory>/.lock,\n"
-"so no race condition  between simultaneously running instances of the\n"
-"program are possible.\n"
-"\n"
-"COMMANDS\n"
-"    afilecache <cache directory> put <ID> <file path>\n"
-"    Put a file located at <file path> into a <cache directory> with an\n"
-"    identifier <ID>.\n"
-"\n"
-"    afilecache <cache directory> get <ID> <file path>\n"
-"    Look up a file identified by <ID> in a <cache directory> and copy it\n"
-"    to <file path>.\n"
-"    If <ID> is missing in the cache, afilecache exits with code 2.\n"
-"    Before copying the file to <file path>, afilecache unlinks <file path>.\n"
-"    If copying has failed, afilecache tries to unlink partially copied file\n"
-"    at <file path> too.\n"
-"\n"
-"    afilecache <cache directory> delete <ID>\n"
-"    Delete a file identified by <ID> from a <cache directory>.\n"
-"    If <ID> is missing in the cache, exits with code 2.\n"
-"\n"
-"EXIT CODES\n"
-"   0 operation completed successfully\n"
-"   1 invalid command line arguments\n"
-"   2 missing <ID>\n"
-"   3 internal error\n"
-"   4 <cache directory> not found or not a directory\n"
-"   5 file operation failed\n"
-"   6 lock failed\n"
-"\n"
-"BUGS\n"
-"   Please report bugs at <igeekless@gmail.com>.\n"
-"\n"
-"Copyright 2014-2017 Vadim Ushakov <igeekless@gmail.com>\n"
-"\n"
-"Permission is hereby granted, free of charge, to any person obtaining a \n"
-"copy of this software and associated documentation files (the \"Software\"), \n"
-"to deal in the Software without restriction, including without limitation \n"
-"the rights to use, copy, modify, merge, publish, distribute, sublicense, \n"
-"and/or sell copies of the Software, and to permit persons to whom the \n"
-"Software is furnished to do so, subject to the following conditions:\n"
-"\n"
-"The above copyright notice and this permission notice shall be included in \n"
-"all copies or substantial portions of the Software.\n"
-"\n"
-"THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR \n"
-"IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, \n"
-"FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL \n"
-"THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER \n"
-"LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING \n"
-"FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER \n"
-"DEALINGS IN THE SOFTWARE.\n"
-"\n"
-;
+const char * USAGE = 
+"Version 0.1.1\n"
+"Usage:\n"
+"    afilecache <cache directory> put [options] <ID> <file path>\n"
+"    afilecache <cache directory> get [options] <ID> <file path>\n"
+"    afilecache <cache directory> delete [options] <ID>\n"
+"    afilecache <cache directory> clean [<max size in MB>]\n"
+"    afilecache <cache directory> stats\n"
+"    afilecache <cache directory> shards\n"
+"    afilecache <cache directory> reindex\n"
+"    afilecache <cache directory> migrate [--fanout=<fanout>]\n"
+"    afilecache <cache directory> config [<name> [<value>]]\n"
+"    afilecache <cache directory> serve --socket=<path>\n"
+"    afilecache <cache directory> batch [--null]\n"
+"    afilecache <cache directory> mput [options] [<manifest>]\n"
+"    afilecache <cache directory> mget [options] [<manifest>]\n"
+"\n"
+"afilecache is a utility to atomically put files in a cache directory.\n"
+"\n"
+"When modifying the cache,  afilecache acquires a lock on\n"
+"<cache directory>/.lock, so no race condition between simultaneously\n"
+"running instances of the program are possible. The lock is taken per\n"
+"cache subdirectory, so IDs stored in different subdirectories are\n"
+"processed in parallel. Files are published with an atomic rename,\n"
+"so get never waits for the lock.\n"
+"\n"
+"COMMANDS\n"
+"    afilecache <cache directory> put <ID> <file path>\n"
+"    Put a file located at <file path> into a <cache directory> with an\n"
+"    identifier <ID>.\n"
+"\n"
+"    afilecache <cache directory> get <ID> <file path>\n"
+"    Look up a file identified by <ID> in a <cache directory> and copy it\n"
+"    to <file path>.\n"
+"    If <ID> is missing in the cache, afilecache exits with code 2.\n"
+"    Most misses are answered by the Bloom filter\n"
+"    <cache directory>/.bloom without looking up the file. It is rebuilt\n"
+"    by clean and reindex, which drops the IDs of deleted files. Files\n"
+"    put by older versions of afilecache, which don't update the\n"
+"    filter, are reported as missing until reindex is run.\n"
+"    Before copying the file to <file path>, afilecache unlinks <file path>.\n"
+"    If copying has failed, afilecache tries to unlink partially copied file\n"
+"    at <file path> too.\n"
+"    With --link, the file is linked instead of being copied.\n"
+"\n"
+"    afilecache <cache directory> delete <ID>\n"
+"    Delete a file identified by <ID> from a <cache directory>.\n"
+"    If <ID> is missing in the cache, exits with code 2.\n"
+"\n"
+"    afilecache <cache directory> clean [<max size in MB>]\n"
+"    Delete the least recently accessed files until the total size of\n"
+"    the files in a <cache directory> is at most <max size in MB>, or\n"
+"    low_watermark if omitted, and the filesystem has target_free space\n"
+"    available, see config.\n"
+"    Sizes and access times are taken from the index file\n"
+"    <cache directory>/.index, which put, get and delete keep up to date,\n"
+"    so this works with any atime mount option and without scanning\n"
+"    the cache directories.\n"
+"\n"
+"    afilecache <cache directory> stats\n"
+"    Print the number of files in a <cache directory> as\n"
+"    \"entries <count>\" and their total size in bytes as \"size <bytes>\".\n"
+"    The totals are maintained in the index by put and delete, so this\n"
+"    takes constant time.\n"
+"\n"
+"    afilecache <cache directory> shards\n"
+"    Print how the files are spread over the subdirectories of a\n"
+"    <cache directory>, as \"<name> <value>\" lines: the layout and the\n"
+"    fanout, the number of subdirectories holding files, how many of\n"
+"    them are used, the number of files, the number of files not moved\n"
+"    by migrate yet, which are left out, the most files in one\n"
+"    subdirectory, the mean and the ratio of the variance to the mean,\n"
+"    which is close to 1 when the files are spread evenly and grows as\n"
+"    they cluster.\n"
+"\n"
+"    afilecache <cache directory> reindex\n"
+"    Rebuild the index from the files in a <cache directory>. This is\n"
+"    needed for files put by older versions of afilecache, which get\n"
+"    would not find otherwise, repairs the totals reported by stats and\n"
+"    is done automatically when the index is missing or damaged. Access\n"
+"    times are taken from the filesystem, and the costs given to put\n"
+"    with --cost are lost: all files get the default cost.\n"
+"    Temporary files left by interrupted put commands are removed too.\n"
+"\n"
+"    afilecache <cache directory> migrate [--fanout=<fanout>]\n"
+"    Move the files of a <cache directory> to layout 2 with the given\n"
+"    fanout, or the current one, see config. The cache stays in use\n"
+"    meanwhile: put stores files in the new layout right away, get and\n"
+"    delete look for them in both layouts until the migration is\n"
+"    complete. Files are moved one at a time, an interrupted migration\n"
+"    is completed by running migrate again.\n"
+"\n"
+"    afilecache <cache directory> config [<name> [<value>]]\n"
+"    Print all settings of a <cache directory>, print the value of\n"
+"    the setting <name>, or set it to <value>. The settings are stored\n"
+"    in <cache directory>/.config as \"<name>=<value>\" lines. Sizes are\n"
+"    given in bytes, optionally followed by K, M, G or T.\n"
+"\n"
+"    layout=1|2\n"
+"    How IDs are assigned to subdirectories. Layout 2 hashes IDs\n"
+"    evenly, layout 1 is the one of older versions of afilecache, where\n"
+"    IDs with common prefixes may crowd a few subdirectories. New caches\n"
+"    get layout 2, caches used by older versions keep layout 1. The\n"
+"    layout can only be changed while the cache is empty, use migrate\n"
+"    otherwise.\n"
+"\n"
+"    fanout=default|<depth>x<width>\n"
+"    The subdirectories of a cache: <depth> levels of up to 3 with\n"
+"    <width> subdirectories each, named by hexadecimal numbers, so 2x256\n"
+"    stores files in 00/00 to ff/ff. Fewer subdirectories suit small\n"
+"    caches, more of them keep directories small in large ones. The\n"
+"    default is a single level of 390625 four-letter subdirectories.\n"
+"    The fanout can only be changed while the cache is empty, use\n"
+"    migrate otherwise.\n"
+"\n"
+"    migrate_from_layout, migrate_from_fanout\n"
+"    The previous settings during a migration, see migrate.\n"
+"\n"
+"    high_watermark, low_watermark\n"
+"    Once the total size of the files exceeds high_watermark, every put\n"
+"    deletes a few of the least recently accessed files, until the total\n"
+"    size falls to low_watermark. low_watermark defaults to\n"
+"    high_watermark, 0 disables automatic deletion (the default).\n"
+"\n"
+"    min_free, target_free\n"
+"    Likewise, once the space available on the filesystem of\n"
+"    <cache directory> falls below min_free, put deletes files until it\n"
+"    reaches target_free. Both are given as a size or as a percentage of\n"
+"    the filesystem size, e.g. 10%%. target_free defaults to min_free,\n"
+"    0 disables automatic deletion (the default).\n"
+"\n"
+"    admission=always|tinylfu\n"
+"    Select which files put stores. always (the default) stores all of\n"
+"    them. With tinylfu, the number of requests for every <ID> by get\n"
+"    and put is estimated in <cache directory>/.sketch, and while the\n"
+"    cache is full, that is, above the watermarks, put silently drops\n"
+"    a new file unless it has been requested more often than the files\n"
+"    it would displace. Eviction also deletes rarely requested files\n"
+"    first. This keeps a flood of files used only once from pushing\n"
+"    the working set out of the cache.\n"
+"\n"
+"    eviction_policy=lru|sample|clock|gdsf\n"
+"    Select how put and clean choose the files to delete. lru (the\n"
+"    default) makes clean scan the whole index for the least recently\n"
+"    accessed files, put samples it like sample does. sample repeatedly\n"
+"    picks a few random files and deletes the least recently accessed\n"
+"    one seen so far, which approximates lru at a cost independent of\n"
+"    the number of files. clock sweeps the index in a circle, deleting\n"
+"    files not read by get since the previous sweep and giving the\n"
+"    others a second chance. gdsf (GreedyDual-Size-Frequency) deletes\n"
+"    the files with the lowest number of requests times cost per byte\n"
+"    first, see --cost, and ages files not requested lately. Like lru,\n"
+"    it is approximated by sampling in put.\n"
+"\n"
+"    afilecache <cache directory> serve --socket=<path>\n"
+"    Run in the foreground as a daemon serving put, get and delete\n"
+"    requests for <cache directory> on the Unix domain socket <path>.\n"
+"    The daemon saves the cost of starting a process per operation.\n"
+"    Error messages of forwarded requests are printed by the daemon.\n"
+"\n"
+"    afilecache <cache directory> batch [--null]\n"
+"    Read put, get and delete commands from the standard input, one per\n"
+"    line, e.g. \"get <ID> <file path>\", and execute them in order.\n"
+"    Fields are separated by whitespace and may start with options.\n"
+"    For every command, a line with its exit code is written to\n"
+"    the standard output. With --null, every field is terminated by a\n"
+"    NUL character and every command by an empty field, so fields may\n"
+"    contain any other character.\n"
+"\n"
+"    afilecache <cache directory> mput [--jobs=<n>] [--null] [<manifest>]\n"
+"    afilecache <cache directory> mget [--jobs=<n>] [--null] [<manifest>]\n"
+"    Put or get all files listed in <manifest>, or in the standard\n"
+"    input if it is omitted or \"-\", as \"<ID> <file path>\" pairs in\n"
+"    the format of batch commands. The files are processed in parallel\n"
+"    by <n> threads, by default one per CPU. Once all files are done,\n"
+"    the exit code for each pair is written as a line to the standard\n"
+"    output, in the order of the manifest. put and get options apply\n"
+"    to all pairs.\n"
+"\n"
+"OPTIONS\n"
+"    --reflink=auto|always|never\n"
+"    Control whether put and get share data blocks between the cache and\n"
+"    <file path> on filesystems supporting reflinks (btrfs, XFS, ...).\n"
+"    auto (the default) falls back to copying when reflinking is\n"
+"    not possible, always fails instead, never always copies.\n"
+"\n"
+"    --link=copy|hard|sym|auto\n"
+"    Select how get delivers the file to <file path>: copy (the default)\n"
+"    makes a private copy, hard creates a hard link to the cache entry,\n"
+"    sym creates a symbolic link to it, auto tries a hard link and copies\n"
+"    if that is not possible. Cache entries are read-only, so linked files\n"
+"    must not be modified in place. A symbolic link dangles once the entry\n"
+"    is deleted from the cache.\n"
+"\n"
+"    --cost=<seconds>\n"
+"    Tell put how long it takes to recreate the file, e.g. the build\n"
+"    time. eviction_policy=gdsf keeps files that are expensive to\n"
+"    recreate per byte longer. The default is 1 second.\n"
+"\n"
+"    --socket=<path>\n"
+"    Forward put, get and delete to the daemon listening on <path>.\n"
+"    The AFILECACHE_SOCKET environment variable has the same effect.\n"
+"    If no daemon is listening, the request is executed directly.\n"
+"    File data is exchanged as open file descriptors: <file path> is\n"
+"    opened or created by the client, not by the daemon.\n"
+"\n"
+"    --\n"
+"    Stop option processing, e.g. for IDs starting with \"--\".\n"
+"\n"
+"EXIT CODES\n"
+"   0 operation completed successfully\n"
+"   1 invalid command line arguments\n"
+"   2 missing <ID>\n"
+"   3 internal error\n"
+"   4 <cache directory> not found or not a directory\n"
+"   5 file operation failed\n"
+"   6 lock failed\n"
+"\n"
+"BUGS\n"
+"   Please report bugs at <igeekless@gmail.com>.\n"
+"\n"
+"Copyright 2014-2017 Vadim Ushakov <igeekless@gmail.com>\n"
+"\n"
+"Permission is hereby granted, free of charge, to any person obtaining a \n"
+"copy of this software and associated documentation files (the \"Software\"), \n"
+"to deal in the Software without restriction, including without limitation \n"
+"the rights to use, copy, modify, merge, publish, distribute, sublicense, \n"
+"and/or sell copies of the Software, and to permit persons to whom the \n"
+"Software is furnished to do so, subject to the following conditions:\n"
+"\n"
+"The above copyright notice and this permission notice shall be included in \n"
+"all copies or substantial portions of the Software.\n"
+"\n"
+"THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR \n"
+"IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, \n"
+"FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL \n"
+"THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER \n"
+"LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING \n"
+"FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER \n"
+"DEALINGS IN THE SOFTWARE.\n"
+"\n"
+;
+
+static void usage(void)
+{
+    fprintf(stderr, USAGE);
+}
+
+#define USAGE_CHECK(check) \
+if (!(check)) {  \
+    usage();  \
+    return RET_USAGE; \
+}
+
+#define MAX_ARGS 8
+
+typedef struct _request_t {
+    const char * command;
+    const char * cache_id;
+    const char * file_path;
+    unsigned long long max_size;
+    int          link_mode;
+    int          reflink_mode;
+    const char * socket_path;
+    int          null_separated;
+    int          jobs;
+    const char * manifest_path;
+    const char * config_name;
+    const char * config_value;
+    uint32_t     cost; /* milliseconds */
+    fanout_t     fanout;
+    int          fanout_set;
+} request_t;
+
+/* Indexed by the values of REFLINK_MODES and LINK_MODES. */
+static const char * const REFLINK_MODE_NAMES[] = {"never", "auto", "always", NULL};
+static const char * const LINK_MODE_NAMES[] = {"copy", "hard", "sym", "auto", NULL};
+
+static int is_command(const request_t * request, const char * command)
+{
+    return strcmp(request->command, command) == 0;
+}
+
+static int is_forwardable(const request_t * request)
+{
+    return is_command(request, "put") || is_command(request, "get") || is_command(request, "delete");
+}
+
+static int is_multi_command(const request_t * request)
+{
+    return is_command(request, "mput") || is_command(request, "mget");
+}
+
+static int option_takes_value(const char * name)
+{
+    return strcmp(name, "reflink") == 0 || strcmp(name, "link") == 0 || strcmp(name, "socket") == 0 ||
+           strcmp(name, "jobs") == 0 || strcmp(name, "cost") == 0 || strcmp(name, "fanout") == 0;
+}
+
+static int parse_option(request_t * request, const char * name, const char * value)
+{
+    if (strcmp(name, "reflink") == 0 && (is_command(request, "put") || is_command(request, "get") ||
+                                         is_multi_command(request)))
+    {
+        int mode = parse_enum(value, REFLINK_MODE_NAMES);
+        if (mode < 0)
+            return -1;
+        request->reflink_mode = mode;
+        return 0;
+    }
+
+    if (strcmp(name, "link") == 0 && (is_command(request, "get") || is_command(request, "mget")))
+    {
+        int mode = parse_enum(value, LINK_MODE_NAMES);
+        if (mode < 0)
+            return -1;
+        request->link_mode = mode;
+        return 0;
+    }
+
+    if (strcmp(name, "socket") == 0 && (is_forwardable(request) || is_command(request, "serve")))
+    {
+        if (!value || !*value)
+            return -1;
+        request->socket_path = value;
+        return 0;
+    }
+
+    if (strcmp(name, "null") == 0 && (is_command(request, "batch") || is_multi_command(request)))
+    {
+        if (value)
+            return -1;
+        request->null_separated = 1;
+        return 0;
+    }
+
+    if (strcmp(name, "cost") == 0 && (is_command(request, "put") || is_command(request, "mput")))
+    {
+        char * end;
+        double cost = value ? strtod(value, &end) : 0;
+        if (!value || !*value || *end || !(cost >= 0 && cost <= UINT32_MAX / 1000))
+            return -1;
+        request->cost = (uint32_t)(cost * 1000 + 0.5);
+        return 0;
+    }
+
+    if (strcmp(name, "fanout") == 0 && is_command(request, "migrate"))
+    {
+        if (parse_fanout(value, &request->fanout) < 0)
+            return -1;
+        request->fanout_set = 1;
+        return 0;
+    }
+
+    if (strcmp(name, "jobs") == 0 && is_multi_command(request))
+    {
+        char * end;
+        long jobs = value ? strtol(value, &end, 10) : 0;
+        if (!value || !*value || *end || jobs < 1 || jobs > 1024)
+            return -1;
+        request->jobs = jobs;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Parse the arguments following <cache directory>, argv[0] being
+ * the command. The request refers to the strings of argv.
+ */
+static int parse_request(int argc, char ** argv, request_t * request)
+{
+    const char * args[MAX_ARGS];
+    int          nargs = 0;
+    int          options_done = 0;
+    int          i;
+
+    memset(request, 0, sizeof(*request));
+    request->link_mode = LINK_COPY;
+    request->reflink_mode = REFLINK_AUTO;
+
+    if (argc < 1 || !*argv[0])
+        return RET_USAGE;
+
+    request->command = argv[0];
+
+    for (i = 1; i < argc; i++)
+    {
+        const char * arg = argv[i];
+
+        if (!options_done && strcmp(arg, "--") == 0)
+        {
+            options_done = 1;
+        }
+        else if (!options_done && strncmp(arg, "--", 2) == 0)
+        {
+            char name[32];
+            const char * value = strchr(arg + 2, '=');
+            size_t name_len = value ? (size_t)(value - arg - 2) : strlen(arg + 2);
+
+            if (name_len >= sizeof(name))
+                return RET_USAGE;
+            memcpy(name, arg + 2, name_len);
+            name[name_len] = 0;
+
+            if (value)
+                value++;
+            else if (option_takes_value(name) && i + 1 < argc)
+                value = argv[++i];
+
+            if (parse_option(request, name, value) < 0)
+                return RET_USAGE;
+        }
+        else
+        {
+            if (nargs >= MAX_ARGS)
+                return RET_USAGE;
+            args[nargs++] = arg;
+        }
+    }
+
+    if (is_command(request, "put") || is_command(request, "get"))
+    {
+        if (nargs != 2)
+            return RET_USAGE;
+        request->cache_id = args[0];
+        request->file_path = args[1];
+        if (!*request->file_path || !*request->cache_id)
+            return RET_USAGE;
+    }
+    else if (is_command(request, "delete"))
+    {
+        if (nargs != 1)
+            return RET_USAGE;
+        request->cache_id = args[0];
+        if (!*request->cache_id)
+            return RET_USAGE;
+    }
+    else if (is_command(request, "clean"))
+    {
+        char * end;
+        if (nargs > 1)
+            return RET_USAGE;
+        request->max_size = ULLONG_MAX;
+        if (nargs == 1)
+        {
+            errno = 0;
+            request->max_size = strtoull(args[0], &end, 10);
+            if (!*args[0] || *end || args[0][0] == '-' || errno ||
+                request->max_size > ULLONG_MAX / (1024 * 1024))
+                return RET_USAGE;
+            request->max_size *= 1024 * 1024;
+        }
+    }
+    else if (is_command(request, "config"))
+    {
+        if (nargs > 2)
+            return RET_USAGE;
+        request->config_name = nargs > 0 ? args[0] : NULL;
+        request->config_value = nargs > 1 ? args[1] : NULL;
+    }
+    else if (is_command(request, "reindex") || is_command(request, "stats") ||
+             is_command(request, "shards") || is_command(request, "migrate"))
+    {
+        if (nargs != 0)
+            return RET_USAGE;
+    }
+    else if (is_command(request, "serve"))
+    {
+        if (nargs != 0 || !request->socket_path)
+            return RET_USAGE;
+    }
+    else if (is_command(request, "batch"))
+    {
+        if (nargs != 0)
+            return RET_USAGE;
+    }
+    else if (is_multi_command(request))
+    {
+        if (nargs > 1)
+            return RET_USAGE;
+        if (nargs == 1 && strcmp(args[0], "-") != 0)
+            request->manifest_path = args[0];
+    }
+    else
+    {
+        return RET_USAGE;
+    }
+
+    return 0;
+}
+
+static int execute_request(cache_t * cache, const request_t * request)
+{
+    if (is_command(request, "get"))
+    {
+        return command_get(cache, request->cache_id, request->file_path,
+                           request->link_mode, request->reflink_mode);
+    }
+
+    if (cache->lock_fd < 0 && cache_open_lock(cache) < 0)
+        return RET_FILE_OPS;
+
+    if (is_command(request, "put"))
+    {
+        return command_put(cache, request->cache_id, request->file_path, request->reflink_mode, request->cost);
+    }
+    else if (is_command(request, "delete"))
+    {
+        return command_delete(cache, request->cache_id);
+    }
+    else if (is_command(request, "clean"))
+    {
+        return command_clean(cache, request->max_size);
+    }
+    else if (is_command(request, "reindex"))
+    {
+        return command_reindex(cache);
+    }
+    else if (is_command(request, "stats"))
+    {
+        return command_stats(cache);
+    }
+    else if (is_command(request, "shards"))
+    {
+        return command_shards(cache);
+    }
+    else if (is_command(request, "migrate"))
+    {
+        return command_migrate(cache, request->fanout_set ? &request->fanout : NULL);
+    }
+    else if (is_command(request, "config"))
+    {
+        return command_config(cache, request->config_name, request->config_value);
+    }
+
+    return RET_INTERNAL;
+}
+
+
+/*
+ * Read the next command for batch mode: a line of whitespace-separated
+ * fields, or with null_separated, a sequence of NUL-terminated fields
+ * ended by an empty field. The fields point into buffer.
+ * Returns the number of fields, which may exceed max_fields, or -1 at
+ * the end of the input.
+ */
+static int read_batch_command(FILE * stream, int null_separated, str_buffer_t * buffer,
+                              char ** fields, int max_fields)
+{
+    size_t offsets[MAX_ARGS + 2];
+    int nfields = 0;
+    int in_field = 0;
+    int ch;
+
+    if (max_fields > MAX_ARGS + 2)
+        max_fields = MAX_ARGS + 2;
+
+    buffer->len = 0;
+
+    while ((ch = getc(stream)) != EOF)
+    {
+        int separator = null_separated ? ch == 0 : (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+
+        if (!separator)
+        {
+            if (!in_field)
+            {
+                if (nfields < max_fields)
+                    offsets[nfields] = buffer->len;
+                nfields++;
+                in_field = 1;
+            }
+            str_buffer_join_char(buffer, ch);
+            continue;
+        }
+
+        if (in_field)
+        {
+            str_buffer_join_char(buffer, 0);
+            in_field = 0;
+            if (null_separated)
+                continue;
+        }
+        else if (null_separated)
+        {
+            /* An empty field ends the command. */
+            break;
+        }
+
+        if (ch == '\n')
+            break;
+    }
+
+    if (ch == EOF && nfields == 0)
+        return -1;
+
+    if (in_field)
+        str_buffer_join_char(buffer, 0);
+
+    int i;
+    for (i = 0; i < nfields && i < max_fields; i++)
+        fields[i] = buffer->str + offsets[i];
+
+    return nfields;
+}
+
+/*
+ * Execute put, get and delete commands read from the standard input,
+ * writing the exit code of each one as a line to the standard output.
+ * The cache handle, with its open lock file, is shared by all commands.
+ */
+static int command_batch(cache_t * cache, int null_separated)
+{
+    str_buffer_t buffer = {0, 0, 0};
+    char * fields[MAX_ARGS + 2];
+    int nfields;
+
+    while ((nfields = read_batch_command(stdin, null_separated, &buffer, fields, MAX_ARGS + 2)) >= 0)
+    {
+        request_t request;
+        int result;
+
+        if (nfields == 0)
+            continue;
+
+        if (nfields > MAX_ARGS + 2 ||
+            parse_request(nfields, fields, &request) != 0 || !is_forwardable(&request))
+            result = RET_USAGE;
+        else
+            result = execute_request(cache, &request);
+
+        printf("%d\n", result);
+        fflush(stdout);
+    }
+
+    free(buffer.str);
+
+    return 0;
+}
+
+
+typedef struct _manifest_item_t {
+    char * cache_id;
+    char * file_path;
+    int    result;
+} manifest_item_t;
+
+typedef struct _worker_pool_t {
+    const char *      cache_path;
+    const request_t * request;
+    manifest_item_t * items;
+    size_t            nitems;
+    size_t            next_item;
+} worker_pool_t;
+
+static void * pool_worker(void * arg)
+{
+    worker_pool_t * pool = arg;
+    const request_t * request = pool->request;
+    size_t i;
+
+    /* Every worker needs its own lock file descriptor for the locks to exclude each other. */
+    cache_t cache;
+    cache_init(&cache, pool->cache_path);
+
+    while ((i = __atomic_fetch_add(&pool->next_item, 1, __ATOMIC_RELAXED)) < pool->nitems)
+    {
+        manifest_item_t * item = &pool->items[i];
+
+        if (!item->cache_id)
+            item->result = RET_USAGE;
+        else if (is_command(request, "mget"))
+            item->result = command_get(&cache, item->cache_id, item->file_path,
+                                       request->link_mode, request->reflink_mode);
+        else if (cache.lock_fd < 0 && cache_open_lock(&cache) < 0)
+            item->result = RET_FILE_OPS;
+        else
+            item->result = command_put(&cache, item->cache_id, item->file_path, request->reflink_mode,
+                                       request->cost);
+    }
+
+    cache_close(&cache);
+
+    return NULL;
+}
+
+/*
+ * Execute a manifest of "<ID> <file path>" pairs, in the same format as
+ * batch commands, with a pool of worker threads. The exit codes are
+ * written in the order of the manifest once all items are done.
+ */
+static int command_multi(const char * cache_path, const request_t * request)
+{
+    FILE * stream = stdin;
+    str_buffer_t buffer = {0, 0, 0};
+    char * fields[3];
+    int nfields;
+
+    worker_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.cache_path = cache_path;
+    pool.request = request;
+
+    if (request->manifest_path)
+    {
+        stream = fopen(request->manifest_path, "r");
+        if (!stream)
+        {
+            perrorf("%s: failed to open %s", progname, request->manifest_path);
+            return RET_FILE_OPS;
+        }
+    }
+
+    size_t capacity = 0;
+    while ((nfields = read_batch_command(stream, request->null_separated, &buffer, fields, 3)) >= 0)
+    {
+        if (nfields == 0)
+            continue;
+
+        if (pool.nitems == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            pool.items = realloc(pool.items, capacity * sizeof(manifest_item_t));
+            if (!pool.items)
+            {
+                fprintf(stderr, "%s: Internal error: failed to allocate %zu items\n", progname, capacity);
+                abort();
+            }
+        }
+
+        manifest_item_t * item = &pool.items[pool.nitems++];
+        memset(item, 0, sizeof(*item));
+        if (nfields == 2 && *fields[0] && *fields[1])
+        {
+            item->cache_id = strdup(fields[0]);
+            item->file_path = strdup(fields[1]);
+        }
+    }
+
+    free(buffer.str);
+    if (stream != stdin)
+        fclose(stream);
+
+    long njobs = request->jobs;
+    if (njobs <= 0)
+        njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (njobs <= 0)
+        njobs = 1;
+    if ((size_t)njobs > pool.nitems)
+        njobs = pool.nitems;
+
+    pthread_t * threads = calloc(njobs ? njobs : 1, sizeof(pthread_t));
+    long nthreads;
+    for (nthreads = 0; nthreads < njobs; nthreads++)
+    {
+        if (pthread_create(&threads[nthreads], NULL, pool_worker, &pool) != 0)
+            break;
+    }
+
+    /* Without threads, at least do the job sequentially. */
+    if (nthreads == 0)
+        pool_worker(&pool);
+
+    long i;
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    size_t j;
+    for (j = 0; j < pool.nitems; j++)
+    {
+        printf("%d\n", pool.items[j].result);
+        free(pool.items[j].cache_id);
+        free(pool.items[j].file_path);
+    }
+    free(pool.items);
+
+    return 0;
+}
+
+
+/*
+ * Daemon protocol. Requests and replies are messages: a counted list of
+ * length-prefixed strings, optionally accompanied by a file descriptor
+ * passed with SCM_RIGHTS.
+ *
+ * A request holds the absolute path of the cache directory followed by
+ * the arguments that would follow it on the command line. File data
+ * never passes through the daemon: put comes with the source file opened
+ * by the client, and the reply to a successful get comes with the cache
+ * entry opened by the daemon, so that the client copies or links it
+ * itself. <file path> is only used in error messages.
+ *
+ * A reply holds the exit code of the command and, for a successful get,
+ * the path of the cache entry. A connection may carry any number of
+ * requests.
+ */
+
+#define PROTO_MAX_STRINGS (MAX_ARGS + 8)
+#define PROTO_MAX_STRING_LEN 16384
+
+static int write_all(int fd, const void * buf, size_t len)
+{
+    const char * ptr = buf;
+
+    while (len > 0)
+    {
+        ssize_t nwritten = write(fd, ptr, len);
+        if (nwritten < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += nwritten;
+        len -= nwritten;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void * buf, size_t len)
+{
+    char * ptr = buf;
+
+    while (len > 0)
+    {
+        ssize_t nread = read(fd, ptr, len);
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nread == 0)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        ptr += nread;
+        len -= nread;
+    }
+
+    return 0;
+}
+
+static int send_message(int sock, int count, const char * const * strings, int pass_fd)
+{
+    str_buffer_t buffer = {0, 0, 0};
+    uint32_t value = count;
+    size_t sent = 0;
+    int i, result;
+
+    str_buffer_extend(&buffer, sizeof(value));
+    memcpy(buffer.str, &value, sizeof(value));
+    buffer.len = sizeof(value);
+
+    for (i = 0; i < count; i++)
+    {
+        value = strlen(strings[i]);
+        str_buffer_extend(&buffer, sizeof(value) + value);
+        memcpy(buffer.str + buffer.len, &value, sizeof(value));
+        memcpy(buffer.str + buffer.len + sizeof(value), strings[i], value);
+        buffer.len += sizeof(value) + value;
+    }
+
+    if (pass_fd >= 0)
+    {
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct iovec iov;
+        struct msghdr msg;
+        ssize_t nsent;
+
+        memset(&control, 0, sizeof(control));
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buffer.str;
+        iov.iov_len = buffer.len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+
+        while ((nsent = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            ;
+        if (nsent < 0)
+        {
+            free(buffer.str);
+            return -1;
+        }
+        sent = nsent;
+    }
+
+    result = write_all(sock, buffer.str + sent, buffer.len - sent);
+    free(buffer.str);
+
+    return result;
+}
+
+/*
+ * Receive a message. The strings and the array are allocated as a single
+ * block to be released with free(*strings). A passed descriptor is
+ * returned in *passed_fd, -1 otherwise.
+ * Returns 1 on EOF.
+ */
+static int recv_message(int sock, int * count, char *** strings, int * passed_fd)
+{
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t nread;
+    uint32_t n, len;
+    uint32_t lens[PROTO_MAX_STRINGS];
+    size_t total = 0;
+    uint32_t i;
+
+    *passed_fd = -1;
+
+    /* The descriptor arrives with the first byte of the message. */
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &n;
+    iov.iov_len = sizeof(n);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    while ((nread = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (nread <= 0)
+        return nread == 0 ? 1 : -1;
+
+    struct cmsghdr * cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        {
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    str_buffer_t buffer = {0, 0, 0};
 
-static void usage(void)
+    if (read_all(sock, (char *)&n + nread, sizeof(n) - nread) != 0)
+        goto out_error;
+
+    if (n > PROTO_MAX_STRINGS)
+    {
+        errno = EPROTO;
+        goto out_error;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (read_all(sock, &len, sizeof(len)) != 0)
+            goto out_error;
+        if (len > PROTO_MAX_STRING_LEN)
+        {
+            errno = EPROTO;
+            goto out_error;
+        }
+        lens[i] = len;
+        str_buffer_extend(&buffer, len + 1);
+        if (read_all(sock, buffer.str + buffer.len, len) != 0)
+            goto out_error;
+        buffer.len += len;
+        buffer.str[buffer.len++] = 0;
+        total += len + 1;
+    }
+
+    char ** array = malloc(sizeof(char *) * (n + 1) + total);
+    if (!array)
+        goto out_error;
+
+    char * ptr = (char *)(array + n + 1);
+    if (total)
+        memcpy(ptr, buffer.str, total);
+    for (i = 0; i < n; i++)
+    {
+        array[i] = ptr;
+        ptr += lens[i] + 1;
+    }
+    array[n] = NULL;
+
+    free(buffer.str);
+    *count = n;
+    *strings = array;
+    return 0;
+
+  out_error:
+    free(buffer.str);
+    if (*passed_fd >= 0)
+        close(*passed_fd);
+    *passed_fd = -1;
+    return -1;
+}
+
+static int connect_to_daemon(const char * socket_path)
 {
-    fprintf(stderr, USAGE);
+    struct sockaddr_un addr;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
 }
 
-#define USAGE_CHECK(check) \
-if (!(check)) {  \
-    usage();  \
-    return RET_USAGE; \
+/*
+ * Run the request in the daemon listening on request->socket_path.
+ * Returns the exit code of the command, or -1 if the daemon could not be
+ * reached and the request should be executed locally.
+ */
+static int forward_request(const char * cache_path, const request_t * request)
+{
+    const char * strings[PROTO_MAX_STRINGS];
+    char reflink_option[32];
+    char cost_option[32];
+    int count = 0;
+    int result = -1;
+    int sock = -1;
+    int fd_from = -1;
+
+    char * abs_cache_path = realpath(cache_path, NULL);
+    if (!abs_cache_path)
+        goto out;
+
+    snprintf(reflink_option, sizeof(reflink_option), "--reflink=%s", REFLINK_MODE_NAMES[request->reflink_mode]);
+
+    strings[count++] = abs_cache_path;
+    strings[count++] = request->command;
+    if (is_command(request, "put"))
+        strings[count++] = reflink_option;
+    if (is_command(request, "put") && request->cost)
+    {
+        snprintf(cost_option, sizeof(cost_option), "--cost=%u.%03u", request->cost / 1000, request->cost % 1000);
+        strings[count++] = cost_option;
+    }
+    strings[count++] = "--";
+    strings[count++] = request->cache_id;
+    if (request->file_path)
+        strings[count++] = request->file_path;
+
+    sock = connect_to_daemon(request->socket_path);
+    if (sock < 0)
+        goto out;
+
+    if (is_command(request, "put"))
+    {
+        fd_from = open(request->file_path, O_RDONLY | O_CLOEXEC);
+        if (fd_from < 0)
+        {
+            perrorf("%s: failed to open %s", progname, request->file_path);
+            result = RET_FILE_OPS;
+            goto out;
+        }
+    }
+
+    int reply_count;
+    char ** reply;
+    int fd_entry;
+
+    if (send_message(sock, count, strings, fd_from) < 0 ||
+        recv_message(sock, &reply_count, &reply, &fd_entry) != 0)
+    {
+        perrorf("%s: lost connection to %s", progname, request->socket_path);
+        result = RET_INTERNAL;
+        goto out;
+    }
+
+    result = reply_count > 0 ? atoi(reply[0]) : RET_INTERNAL;
+
+    if (is_command(request, "get") && result == 0)
+    {
+        if (fd_entry < 0 || reply_count < 2)
+            result = RET_INTERNAL;
+        else
+            result = deliver_entry(reply[1], fd_entry, request->file_path,
+                                   request->link_mode, request->reflink_mode);
+    }
+
+    if (fd_entry >= 0)
+        close(fd_entry);
+    free(reply);
+
+  out:
+    if (fd_from >= 0)
+        close(fd_from);
+    if (sock >= 0)
+        close(sock);
+    free(abs_cache_path);
+
+    return result;
 }
 
 
-int main(int argc, char **argv) {
+#define SERVER_MAX_IDLE_CACHES 64
 
-    const char * cache_path;
-    const char * command;
+typedef struct _server_t {
+    const char *    cache_path;
+    char *          abs_cache_path;
+    struct stat     cache_stat;
 
-    const char * source_file_path = NULL;
-    const char * cache_id = NULL;
+    pthread_mutex_t mutex;
+    cache_t *       idle_caches[SERVER_MAX_IDLE_CACHES];
+    int             nidle_caches;
+} server_t;
 
-    int          max_size_mb = 0;
+typedef struct _connection_t {
+    server_t * server;
+    int        fd;
+} connection_t;
 
-    progname = argv[0];
+/*
+ * Every connection works with its own cache handle, so that byte-range
+ * locks of concurrent requests exclude each other. Handles and their
+ * open lock files are kept for reuse by later connections.
+ */
+static cache_t * server_acquire_cache(server_t * server)
+{
+    cache_t * cache = NULL;
 
-    USAGE_CHECK(argc >= 3)
+    pthread_mutex_lock(&server->mutex);
+    if (server->nidle_caches > 0)
+        cache = server->idle_caches[--server->nidle_caches];
+    pthread_mutex_unlock(&server->mutex);
 
-    cache_path = argv[1];
-    command    = argv[2];
+    if (cache)
+        return cache;
+
+    cache = malloc(sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    /* Entry paths are sent to clients, which may run in another directory. */
+    cache_init(cache, server->abs_cache_path);
+    if (cache_open_lock(cache) < 0)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+static void server_release_cache(server_t * server, cache_t * cache)
+{
+    pthread_mutex_lock(&server->mutex);
+    if (server->nidle_caches < SERVER_MAX_IDLE_CACHES)
+    {
+        server->idle_caches[server->nidle_caches++] = cache;
+        cache = NULL;
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    if (cache)
+    {
+        cache_close(cache);
+        free(cache);
+    }
+}
+
+static int server_is_own_cache(server_t * server, const char * cache_path)
+{
+    struct stat stat_buf;
+
+    if (strcmp(cache_path, server->abs_cache_path) == 0)
+        return 1;
+
+    return stat(cache_path, &stat_buf) == 0 &&
+           stat_buf.st_dev == server->cache_stat.st_dev &&
+           stat_buf.st_ino == server->cache_stat.st_ino;
+}
+
+static int server_handle_request(server_t * server, int argc, char ** argv, int fd_passed,
+                                 int * fd_reply, char ** entry_path)
+{
+    request_t request;
 
-    USAGE_CHECK(*cache_path && *command)
+    if (argc < 2)
+        return RET_USAGE;
 
-    if (strcmp(command, "put") == 0 || strcmp(command, "get") == 0)
+    if (!server_is_own_cache(server, argv[0]))
     {
-        USAGE_CHECK(argc == 5)
-        cache_id = argv[3];
-        source_file_path = argv[4];
-        USAGE_CHECK(*source_file_path && *cache_id)
+        fprintf(stderr, "%s: %s: Not served by this daemon\n", progname, argv[0]);
+        return RET_NO_CACHE_DIR;
     }
-    else if (strcmp(command, "delete") == 0)
+
+    if (parse_request(argc - 1, argv + 1, &request) != 0 || !is_forwardable(&request))
+        return RET_USAGE;
+
+    if (is_command(&request, "put") && fd_passed < 0)
+        return RET_USAGE;
+
+    cache_t * cache = server_acquire_cache(server);
+    if (!cache)
+        return RET_INTERNAL;
+
+    int result;
+
+    if (is_command(&request, "get"))
     {
-        USAGE_CHECK(argc == 4)
-        cache_id = argv[3];
-        USAGE_CHECK(*cache_id)
+        *fd_reply = open_entry(cache, request.cache_id, entry_path);
+        result = *fd_reply < 0 ? RET_MISS : 0;
     }
-    else if (strcmp(command, "clean") == 0)
+    else if (is_command(&request, "put"))
     {
-        USAGE_CHECK(argc == 4)
-        max_size_mb = atoi(argv[4]);
+        result = put_entry_fd(cache, request.cache_id, fd_passed, request.file_path, request.reflink_mode,
+                              request.cost);
     }
     else
     {
-        USAGE_CHECK(0)
+        result = execute_request(cache, &request);
+    }
+
+    server_release_cache(server, cache);
+
+    return result;
+}
+
+static void * serve_connection(void * arg)
+{
+    connection_t * connection = arg;
+    int argc;
+    char ** argv;
+    int fd_passed;
+
+    while (recv_message(connection->fd, &argc, &argv, &fd_passed) == 0)
+    {
+        int fd_reply = -1;
+        char * entry_path = NULL;
+        char code[16];
+        const char * reply[2] = {code, NULL};
+
+        snprintf(code, sizeof(code), "%d",
+                 server_handle_request(connection->server, argc, argv, fd_passed, &fd_reply, &entry_path));
+        reply[1] = entry_path;
+
+        int sent = send_message(connection->fd, entry_path ? 2 : 1, reply, fd_reply);
+
+        free(argv);
+        free(entry_path);
+        if (fd_passed >= 0)
+            close(fd_passed);
+        if (fd_reply >= 0)
+            close(fd_reply);
+
+        if (sent < 0)
+            break;
     }
 
+    close(connection->fd);
+    free(connection);
+
+    return NULL;
+}
+
+static const char * serve_socket_path = NULL;
+
+static void serve_signal_handler(int sig)
+{
+    if (serve_socket_path)
+        unlink(serve_socket_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static int command_serve(const char * cache_path, const char * socket_path)
+{
+    server_t server;
+    struct sockaddr_un addr;
     struct stat stat_buf;
-    if (stat(cache_path, &stat_buf) != 0) {
+
+    memset(&server, 0, sizeof(server));
+    server.cache_path = cache_path;
+    server.abs_cache_path = realpath(cache_path, NULL);
+    if (!server.abs_cache_path || stat(server.abs_cache_path, &server.cache_stat) < 0)
+    {
         perrorf("%s: %s", progname, cache_path);
         return RET_NO_CACHE_DIR;
     }
+    pthread_mutex_init(&server.mutex, NULL);
 
-    if (!S_ISDIR(stat_buf.st_mode)) {
-        fprintf(stderr, "%s: %s: Not a directory\n", progname, cache_path);
-        return RET_NO_CACHE_DIR;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: %s: Socket path is too long\n", progname, socket_path);
+        return RET_USAGE;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        perrorf("%s: failed to create a socket", progname);
+        return RET_INTERNAL;
     }
 
-    char * lock_path = str_join_path(cache_path, ".lock", 0);
-    int lock_fd = open(lock_path, O_WRONLY | O_APPEND | O_CREAT, 0666);
-    if (lock_fd < 0) {
-        perrorf("%s: failed to open %s", progname, lock_path);
+    /* A socket left behind by a daemon that has died is replaced. */
+    if (lstat(socket_path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode))
+    {
+        int fd = connect_to_daemon(socket_path);
+        if (fd >= 0)
+        {
+            close(fd);
+            fprintf(stderr, "%s: %s: A daemon is already listening\n", progname, socket_path);
+            return RET_LOCK;
+        }
+        unlink(socket_path);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0)
+    {
+        perrorf("%s: failed to listen on %s", progname, socket_path);
         return RET_FILE_OPS;
     }
 
-    if (flock(lock_fd, LOCK_EX) < 0) {
-        perrorf("%s: failed to lock %s", progname, lock_path);
-        return RET_LOCK;
+    serve_socket_path = socket_path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serve_signal_handler);
+    signal(SIGTERM, serve_signal_handler);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1)
+    {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perrorf("%s: failed to accept a connection on %s", progname, socket_path);
+            return RET_INTERNAL;
+        }
+
+        connection_t * connection = malloc(sizeof(*connection));
+        pthread_t thread;
+        if (!connection)
+        {
+            close(fd);
+            continue;
+        }
+        connection->server = &server;
+        connection->fd = fd;
+
+        if (pthread_create(&thread, &attr, serve_connection, connection) != 0)
+        {
+            fprintf(stderr, "%s: failed to create a thread\n", progname);
+            close(fd);
+            free(connection);
+        }
     }
 
+    /* NOT REACHED */
+
+    return RET_INTERNAL;
+}
+
+
+int main(int argc, char **argv) {
+
+    const char * cache_path;
+    request_t    request;
+
+    progname = argv[0];
+
+    USAGE_CHECK(argc >= 3)
+
+    cache_path = argv[1];
+
+    USAGE_CHECK(*cache_path)
+    USAGE_CHECK(parse_request(argc - 2, argv + 2, &request) == 0)
 
-    if (strcmp(command, "put") == 0)
+    if (!request.socket_path && is_forwardable(&request))
     {
-        return command_put(cache_path, cache_id, source_file_path);
+        const char * socket_path = getenv("AFILECACHE_SOCKET");
+        if (socket_path && *socket_path)
+            request.socket_path = socket_path;
     }
-    else if (strcmp(command, "get") == 0)
+
+    if (request.socket_path && is_forwardable(&request))
     {
-        return command_get(cache_path, cache_id, source_file_path);
+        int result = forward_request(cache_path, &request);
+        if (result >= 0)
+            return result;
+        /* No daemon is running, do the job ourselves. */
+    }
+
+    struct stat stat_buf;
+    if (stat(cache_path, &stat_buf) != 0) {
+        perrorf("%s: %s", progname, cache_path);
+        return RET_NO_CACHE_DIR;
+    }
+
+    if (!S_ISDIR(stat_buf.st_mode)) {
+        fprintf(stderr, "%s: %s: Not a directory\n", progname, cache_path);
+        return RET_NO_CACHE_DIR;
     }
-    else if (strcmp(command, "delete") == 0)
+
+    if (is_command(&request, "serve"))
     {
-        return command_delete(cache_path, cache_id);
+        return command_serve(cache_path, request.socket_path);
     }
-    else if (strcmp(command, "clean") == 0)
+
+    cache_t cache;
+    cache_init(&cache, cache_path);
+
+    if (is_command(&request, "batch"))
     {
-        return command_clean(cache_path, max_size_mb);
+        return command_batch(&cache, request.null_separated);
     }
 
-    /* NOT REACHED */
+    if (is_multi_command(&request))
+    {
+        return command_multi(cache_path, &request);
+    }
 
-    return RET_INTERNAL;
+    return execute_request(&cache, &request);
 }
-